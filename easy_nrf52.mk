@@ -130,13 +130,25 @@ ifndef SDK_CONFIG
 		$(PERL) $(MERGE_CONF_CMD) $(SDK_TEMPLATES) >$(SDK_CONFIG)
 endif
 
-# Possible serial usb or uart
+# Possible serial usb, uart, uarte (EasyDMA with flow control) or rtt (debug probe)
 UART_BAUDRATE ?= 115200
+UART_FLOW_CONTROL ?= 1
+# The uart register value for 1000000 is named 1M
+UART_BAUD_NAME = $(if $(filter 1000000,$(UART_BAUDRATE)),1M,$(UART_BAUDRATE))
+# Usb, uarte and rtt send buffer, written data is transferred in the background
+SERIAL_TX_BUFF_SIZE ?= 2048
+# Rtt channel and input poll interval, channel 0 is used by the log
+RTT_CHANNEL ?= 1
+RTT_POLL_MS ?= 10
+# Received lines queued for enrf_serial_read (power of two)
+SERIAL_RX_LINES ?= 4
+CFLAGS += -DENRF_SERIAL_RX_LINES=$(SERIAL_RX_LINES)
 ifeq ($(ENRF_SERIAL),usb)
   CFLAGS += -DAPP_USBD_CDC_ACM_ENABLED=1 -DAPP_USBD_ENABLED=1 -DNRFX_USBD_ENABLED=1 \
 	          -DPOWER_ENABLED=1 -DNRFX_SYSTICK_ENABLED=1 -DUSBD_POWER_DETECTION=1 \
             -DNRFX_USBD_CONFIG_IRQ_PRIORITY=3 \
 	          -DENRF_SERIAL_USB
+  CFLAGS += -DENRF_SERIAL_TX_BUFF_SIZE=$(SERIAL_TX_BUFF_SIZE)
   SRC_FILES += \
     $(SDK_ROOT)/components/libraries/usbd/app_usbd.c \
     $(SDK_ROOT)/components/libraries/usbd/class/cdc/acm/app_usbd_cdc_acm.c \
@@ -149,7 +161,27 @@ ifeq ($(ENRF_SERIAL),usb)
     $(SDK_ROOT)/modules/nrfx/drivers/src/nrfx_systick.c
 else ifeq ($(ENRF_SERIAL),uart)
   UART_LOG = 0
-  CFLAGS += -DENRF_SERIAL_UART -DUART_BAUD_RATE=UART_BAUDRATE_BAUDRATE_Baud$(UART_BAUDRATE)
+  CFLAGS += -DENRF_SERIAL_UART -DUART_BAUD_RATE=UART_BAUDRATE_BAUDRATE_Baud$(UART_BAUD_NAME)
+else ifeq ($(ENRF_SERIAL),uarte)
+  UART_LOG = 0
+  CFLAGS += -DENRF_SERIAL_UARTE -DUARTE_BAUD_RATE=NRF_UARTE_BAUDRATE_$(UART_BAUDRATE) \
+            -DENRF_UARTE_HWFC=$(UART_FLOW_CONTROL) -DENRF_SERIAL_TX_BUFF_SIZE=$(SERIAL_TX_BUFF_SIZE) \
+            -DNRF_LIBUARTE_DRV_UARTE0=1 -DNRF_LIBUARTE_DRV_HWFC_ENABLED=1 \
+            -DTIMER_ENABLED=1 -DTIMER1_ENABLED=1 -DTIMER2_ENABLED=1 \
+            -DNRFX_TIMER_ENABLED=1 -DNRFX_TIMER1_ENABLED=1 -DNRFX_TIMER2_ENABLED=1 \
+            -DPPI_ENABLED=1 -DNRFX_PPI_ENABLED=1 -DNRF_QUEUE_ENABLED=1 -DNRF_BALLOC_ENABLED=1
+  INC_FOLDERS += $(SDK_ROOT)/components/libraries/libuarte $(SDK_ROOT)/components/libraries/queue \
+    $(SDK_ROOT)/components/libraries/balloc
+  SRC_FILES += \
+    $(SDK_ROOT)/components/libraries/libuarte/nrf_libuarte_async.c \
+    $(SDK_ROOT)/components/libraries/libuarte/nrf_libuarte_drv.c \
+    $(SDK_ROOT)/components/libraries/queue/nrf_queue.c \
+    $(SDK_ROOT)/components/libraries/balloc/nrf_balloc.c \
+    $(SDK_ROOT)/modules/nrfx/drivers/src/nrfx_timer.c \
+    $(SDK_ROOT)/modules/nrfx/drivers/src/nrfx_ppi.c
+else ifeq ($(ENRF_SERIAL),rtt)
+  CFLAGS += -DENRF_SERIAL_RTT -DENRF_RTT_CHANNEL=$(RTT_CHANNEL) -DENRF_RTT_POLL_MS=$(RTT_POLL_MS) \
+            -DENRF_SERIAL_TX_BUFF_SIZE=$(SERIAL_TX_BUFF_SIZE)
 endif
 ifneq ($(UART_LOG),0)
   # Add the uart backend and set used tx pin
@@ -157,7 +189,7 @@ ifneq ($(UART_LOG),0)
   UART_LOG_PIN ?= TX_PIN_NUMBER
   nrf_log_backend_uart.c_CFLAGS = \
     -include $(BOARD_H) \
-    -DNRF_LOG_BACKEND_UART_TEMP_BUFFER_SIZE=64 -DNRF_LOG_BACKEND_UART_BAUDRATE=UART_BAUDRATE_BAUDRATE_Baud$(UART_BAUDRATE) \
+    -DNRF_LOG_BACKEND_UART_TEMP_BUFFER_SIZE=64 -DNRF_LOG_BACKEND_UART_BAUDRATE=UART_BAUDRATE_BAUDRATE_Baud$(UART_BAUD_NAME) \
     -DNRF_LOG_BACKEND_UART_TX_PIN=$(UART_LOG_PIN)
   CFLAGS += -DNRF_LOG_BACKEND_UART_ENABLED=1 -DNRF_LOG_BACKEND_RTT_ENABLED=0
 endif
@@ -178,6 +210,18 @@ ifeq ($(BUTTONLESS_DFU),1)
     -DNRF_SDH_BLE_SERVICE_CHANGED=1 -DBL_SETTINGS_ACCESS_ONLY -DNRF_DFU_TRANSPORT_BLE=1
 endif
 
+# Discovered GATT databases of peers cached in flash
+GATT_CACHE ?= 0
+ifeq ($(GATT_CACHE),1)
+  INC_FOLDERS += $(SDK_ROOT)/components/libraries/fds $(SDK_ROOT)/components/libraries/fstorage \
+    $(SDK_ROOT)/components/libraries/atomic_flags
+  SRC_FILES += $(SDK_ROOT)/components/libraries/fds/fds.c \
+    $(SDK_ROOT)/components/libraries/fstorage/nrf_fstorage.c \
+    $(SDK_ROOT)/components/libraries/fstorage/nrf_fstorage_sd.c \
+    $(SDK_ROOT)/components/libraries/atomic_flags/nrf_atflags.c
+  CFLAGS += -DENRF_GATT_CACHE -DFDS_ENABLED=1 -DNRF_FSTORAGE_ENABLED=1
+endif
+
 # Memory definitions and linker configuration file
 FLASH_SIZE ?= $(if $(findstring $(CHIP),nrf52840),0x00100000,0x00080000)
 RAM_SIZE ?= $(if $(findstring $(CHIP),nrf52840),0x00040000,0x00010000)
@@ -210,6 +254,46 @@ endif
 UUID_CNT ?= 2
 CFLAGS += -DNRF_SDH_BLE_VS_UUID_COUNT=$(UUID_CNT)
 
+# Number of simultaneous connections in each role
+# Each link requires softdevice RAM, adjust RAM_REDUC if needed
+BLE_CENTRAL_LINKS ?= 1
+BLE_PERIPHERAL_LINKS ?= 1
+CFLAGS += -DNRF_SDH_BLE_CENTRAL_LINK_COUNT=$(BLE_CENTRAL_LINKS) \
+          -DNRF_SDH_BLE_PERIPHERAL_LINK_COUNT=$(BLE_PERIPHERAL_LINKS) \
+          -DNRF_BLE_CONN_PARAMS_MAX_SLAVE_LINK_COUNT=$(BLE_PERIPHERAL_LINKS)
+
+# Number of queued GATT client requests per link
+BLE_GQ_QUEUE_SIZE ?= 4
+CFLAGS += -DNRF_BLE_GQ_QUEUE_SIZE=$(BLE_GQ_QUEUE_SIZE)
+
+# L2CAP connection oriented channels per link and their max SDU size
+L2CAP_CHANNELS ?= 0
+L2CAP_MTU ?= 512
+CFLAGS += -DENRF_L2CAP_CHANNELS=$(L2CAP_CHANNELS) -DENRF_L2CAP_MTU=$(L2CAP_MTU)
+
+# Devices tracked by the scan report deduplication (power of two)
+SCAN_DEDUP_SIZE ?= 64
+CFLAGS += -DENRF_SCAN_DEDUP_SIZE=$(SCAN_DEDUP_SIZE)
+
+# Extended advertising data chains reassembled in parallel when scanning
+ADV_CHAIN_BUFS ?= 2
+CFLAGS += -DENRF_ADV_CHAIN_BUFS=$(ADV_CHAIN_BUFS)
+
+# Size of the per link NUS server and client send queues (power of two)
+NUS_TX_QUEUE_SIZE ?= 1024
+NUS_C_TX_QUEUE_SIZE ?= 1024
+CFLAGS += -DENRF_NUS_TX_QUEUE_SIZE=$(NUS_TX_QUEUE_SIZE) -DENRF_NUS_C_TX_QUEUE_SIZE=$(NUS_C_TX_QUEUE_SIZE)
+
+# BLE link throughput settings
+# Connection event length (1.25 ms units), softdevice queue sizes and connection event extension.
+# Larger values require more softdevice RAM, adjust RAM_REDUC if needed
+BLE_EVENT_LENGTH ?= 6
+BLE_HVN_QUEUE_SIZE ?= 1
+BLE_WRITE_CMD_QUEUE_SIZE ?= 1
+BLE_CONN_EVT_EXT ?= 1
+CFLAGS += -DENRF_EVENT_LENGTH=$(BLE_EVENT_LENGTH) -DENRF_HVN_QUEUE_SIZE=$(BLE_HVN_QUEUE_SIZE) \
+          -DENRF_WRITE_CMD_QUEUE_SIZE=$(BLE_WRITE_CMD_QUEUE_SIZE) -DENRF_CONN_EVT_EXT=$(BLE_CONN_EVT_EXT)
+
 # GCC toolchain commands
 GCC_ARM_PREFIX := $(GCC_ROOT)/bin/arm-none-eabi
 CC = '$(GCC_ARM_PREFIX)-gcc'
@@ -544,11 +628,13 @@ endif
 
 # Serial monitor
 MONITOR_PORT ?= $(PORT_DEF)
-MONITOR_SPEED ?= 115200
+MONITOR_SPEED ?= $(UART_BAUDRATE)
 WAIT_SERIAL = $(PYTHON) $(TOOLS_DIR)/wait_serial.py $(MONITOR_PORT)
 MONITOR_COM ?= $(PYTHON) $(TOOLS_DIR)/miniterm.py --exit-char 3 -e $(shell $(WAIT_SERIAL) $(MONITOR_PORT)) $(MONITOR_SPEED)
 monitor:
-ifneq ($(ENRF_SERIAL),)
+ifeq ($(ENRF_SERIAL),rtt)
+	$(RTT_COM) --channel $(RTT_CHANNEL)
+else ifneq ($(ENRF_SERIAL),)
 	$(MONITOR_COM)
 else ifneq ($(UART_LOG),0)
 	$(MONITOR_COM)
@@ -649,4 +735,25 @@ help:
 	@echo "                         segger or stlink"
 	@echo "  NO_BOOTLOADER        When defined no bootloader will be built or flashed"
 	@echo "  NO_SOFTDEVICE        When defined the softdevice will not be flashed"
+	@echo "  BLE_CENTRAL_LINKS    Max simultaneous connections as central. Default: '$(BLE_CENTRAL_LINKS)'"
+	@echo "  BLE_PERIPHERAL_LINKS Max simultaneous connections as peripheral. Default: '$(BLE_PERIPHERAL_LINKS)'"
+	@echo "  BLE_GQ_QUEUE_SIZE    Queued GATT client requests per link. Default: '$(BLE_GQ_QUEUE_SIZE)'"
+	@echo "  GATT_CACHE           Cache discovered peer databases in flash (0/1). Default: '$(GATT_CACHE)'"
+	@echo "  L2CAP_CHANNELS       L2CAP channels per link. Default: '$(L2CAP_CHANNELS)'"
+	@echo "  L2CAP_MTU            Max L2CAP SDU size. Default: '$(L2CAP_MTU)'"
+	@echo "  SCAN_DEDUP_SIZE      Devices tracked by scan deduplication. Default: '$(SCAN_DEDUP_SIZE)'"
+	@echo "  ADV_CHAIN_BUFS       Extended advertising chains reassembled in parallel. Default: '$(ADV_CHAIN_BUFS)'"
+	@echo "  NUS_TX_QUEUE_SIZE    Per link NUS server send queue size, power of two. Default: '$(NUS_TX_QUEUE_SIZE)'"
+	@echo "  NUS_C_TX_QUEUE_SIZE  Per link NUS client send queue size, power of two. Default: '$(NUS_C_TX_QUEUE_SIZE)'"
+	@echo "  SERIAL_TX_BUFF_SIZE  Usb, uarte and rtt serial send buffer size. Default: '$(SERIAL_TX_BUFF_SIZE)'"
+	@echo "  SERIAL_RX_LINES      Received serial lines queued. Default: '$(SERIAL_RX_LINES)'"
+	@echo "  UART_BAUDRATE        Serial uart and uarte baud rate, up to 1000000. Default: '$(UART_BAUDRATE)'"
+	@echo "  RTT_CHANNEL          RTT channel used with ENRF_SERIAL=rtt, 0 is the log. Default: '$(RTT_CHANNEL)'"
+	@echo "  RTT_POLL_MS          RTT serial input poll interval in ms. Default: '$(RTT_POLL_MS)'"
+	@echo "  UART_FLOW_CONTROL    Use RTS/CTS with ENRF_SERIAL=uarte (0/1). Default: '$(UART_FLOW_CONTROL)'"
+	@echo "  BLE_EVENT_LENGTH     Connection event length in 1.25 ms units. Default: '$(BLE_EVENT_LENGTH)'"
+	@echo "  BLE_HVN_QUEUE_SIZE   Softdevice notification queue size. Default: '$(BLE_HVN_QUEUE_SIZE)'"
+	@echo "  BLE_WRITE_CMD_QUEUE_SIZE"
+	@echo "                       Softdevice write command queue size. Default: '$(BLE_WRITE_CMD_QUEUE_SIZE)'"
+	@echo "  BLE_CONN_EVT_EXT     Set to 0 to disable connection event extension. Default: '$(BLE_CONN_EVT_EXT)'"
 	@echo
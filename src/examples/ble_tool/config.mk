@@ -12,4 +12,7 @@ else
 endif
 
 # Enable buttonless dfu by default
-BUTTONLESS_DFU ?= 1
\ No newline at end of file
+BUTTONLESS_DFU ?= 1
+
+# One l2cap channel per link
+L2CAP_CHANNELS ?= 1
@@ -21,8 +21,10 @@
 #include <stdlib.h>
 #include <ctype.h>
 
-#define BUFF_SIZE 255
-#define MAX_PARAMS 6
+#define BUFF_SIZE 600
+#define MAX_PARAMS 7
+// Advertising data up to the extended advertising limit
+#define ADV_DATA_SIZE 255
 
 // Response output macros
 #define RESP(_form, ...) format_response(_form, ##__VA_ARGS__)
@@ -33,6 +35,7 @@
 // Command input and output macros
 #define CMD_OK(form, ...) RESP_OK("%s "form, m_command, ##__VA_ARGS__)
 #define CMD_ERROR(mess) RESP_ERROR("%s %s", m_command, mess)
+#define CMD_EQ(str) ((strcasecmp(m_command, str) == 0))
 #define BOOL_PARAM(pos) (m_params[pos] != NULL && *m_params[pos] == '1')
 #define DEC_PARAM(pos, def) (m_params[pos] ? strtoul(m_params[pos], NULL, 10) : def)
 #define VALIDATE_NRF(check) do { ret_code_t r = check; if (r == NRF_SUCCESS) { CMD_OK(); } else RESP_ERROR("%s nrf error: %lX", m_command, r); } while (0)
@@ -45,6 +48,42 @@ uint8_t m_data_buff[BUFF_SIZE];
 char m_scan_match[100] = {0};
 bool m_scan_once;
 
+// Link used by connection related commands, the latest connected one unless selected
+uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID;
+
+// Binary scan report batches, see scan_bin command. One is filled by the scan reports
+// while the other is sent
+#define BATCH_SIZE 2048
+#define BATCH_MAGIC 0x5AA5
+// Frame header: magic, payload length, sequence no, dropped reports, report count
+#define BATCH_HEADER_SIZE 9
+typedef struct {
+  uint8_t  data[BATCH_SIZE];
+  uint16_t len;
+  uint8_t  count;
+} batch_t;
+batch_t m_batches[2];
+volatile uint8_t m_batch_fill;
+volatile bool m_batch_full[2];
+volatile bool m_batch_flush;
+uint16_t m_batch_dropped;
+uint16_t m_batch_seq;
+bool m_scan_bin;
+APP_TIMER_DEF(m_batch_timer);
+
+// Ongoing L2CAP stream and received statistics
+#define L2CAP_STREAM_SDU_MAX 512
+uint8_t m_stream_buff[L2CAP_STREAM_SDU_MAX];
+struct {
+  uint16_t conn_handle;
+  uint16_t local_cid;
+  uint32_t left;
+  uint16_t sdu_size;
+} m_stream;
+bool m_l2cap_quiet;
+uint32_t m_l2cap_rx_bytes;
+uint32_t m_l2cap_rx_sdus;
+
 // Current received command
 char m_command[BUFF_SIZE];
 int m_param_cnt = 0;
@@ -69,7 +108,7 @@ static void format_response(const char *form, ...) {
 
 //--------------------------------------------------------------------------
 
-static bool nus_data_received(uint8_t *data, uint32_t length) {
+static bool nus_data_received(uint16_t conn_handle, uint8_t *data, uint32_t length) {
   strlcpy(m_char_buff, (const char*)data, MIN(sizeof(m_char_buff), length));
   char *end_pos = m_char_buff + strlen(m_char_buff) - 1;
   // Trim possible trailing newline
@@ -82,7 +121,7 @@ static bool nus_data_received(uint8_t *data, uint32_t length) {
 
 //--------------------------------------------------------------------------
 
-void nus_c_response(uint8_t *data, uint32_t length) {
+void nus_c_response(uint16_t conn_handle, uint8_t *data, uint32_t length) {
   if (!data && length) {
     RESP_ASYNC("NUS_DETECTED");
   } else if (data) {
@@ -95,23 +134,26 @@ void nus_c_response(uint8_t *data, uint32_t length) {
 static void on_ble_evt(const ble_evt_t *p_ble_evt, void *p_context) {
   switch (p_ble_evt->header.evt_id) {
     case BLE_GAP_EVT_CONNECTED:
-      RESP_ASYNC("CONNECTED");
+      m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+      RESP_ASYNC("CONNECTED:%d", m_conn_handle);
       break;
 
     case BLE_GAP_EVT_DISCONNECTED:
-      RESP_ASYNC("DISCONNECTED 0x%x", p_ble_evt->evt.gap_evt.params.disconnected.reason);
-      break;
-
-    case BLE_GATTC_EVT_WRITE_RSP:
-      RESP_ASYNC("WRITE_RESP:%X,%s", p_ble_evt->evt.gattc_evt.params.write_rsp.handle,
-                 hex_str((uint8_t *)p_ble_evt->evt.gattc_evt.params.write_rsp.data,
-                         p_ble_evt->evt.gattc_evt.params.write_rsp.len));
+      RESP_ASYNC("DISCONNECTED 0x%x;%d", p_ble_evt->evt.gap_evt.params.disconnected.reason,
+                 p_ble_evt->evt.gap_evt.conn_handle);
+      if (p_ble_evt->evt.gap_evt.conn_handle == m_conn_handle) {
+        // Continue with a possible remaining link
+        m_conn_handle = BLE_CONN_HANDLE_INVALID;
+        enrf_get_conn_handles(&m_conn_handle, 1);
+      }
       break;
 
-    case BLE_GATTC_EVT_READ_RSP:
-      RESP_ASYNC("READ_RESP:%X,%s", p_ble_evt->evt.gattc_evt.params.read_rsp.handle,
-                 hex_str((uint8_t *)p_ble_evt->evt.gattc_evt.params.read_rsp.data,
-                         p_ble_evt->evt.gattc_evt.params.read_rsp.len));
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+      // Interval in 1.25 ms units, timeout in 10 ms units
+      RESP_ASYNC("CONN_PARAMS:%d;%d;%d",
+                 p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.max_conn_interval,
+                 p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.slave_latency,
+                 p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.conn_sup_timeout);
       break;
 
     case BLE_GATTC_EVT_HVX:
@@ -130,7 +172,10 @@ static void on_ble_evt(const ble_evt_t *p_ble_evt, void *p_context) {
       break;
     }
     case BLE_GAP_EVT_ADV_SET_TERMINATED:
-      RESP_ASYNC("ADVERTISE:Time out");
+      // Also given when moving on to the next advertising phase
+      if (!enrf_is_advertising()) {
+        RESP_ASYNC("ADVERTISE:Time out");
+      }
       break;
     default:
       break;
@@ -139,18 +184,137 @@ static void on_ble_evt(const ble_evt_t *p_ble_evt, void *p_context) {
 
 //--------------------------------------------------------------------------
 
+static void batch_add(ble_gap_evt_adv_report_t *p_adv_report) {
+  // Report format: time_ms(4) addr_type(1) addr(6) phys(1) rssi(1) data_len(2) data
+  // Primary PHY in the low nibble of phys and secondary in the high
+  uint16_t data_len = MIN(p_adv_report->data.len, BATCH_SIZE - BATCH_HEADER_SIZE - 16);
+  uint16_t rec_len = 15 + data_len;
+  batch_t *p_batch = &m_batches[m_batch_fill];
+  if (p_batch->len + rec_len + 1 > BATCH_SIZE) {
+    // Hand over the full batch and continue in the other one, unless it is still being sent
+    uint8_t other = m_batch_fill ^ 1;
+    if (m_batch_full[other]) {
+      m_batch_dropped++;
+      return;
+    }
+    m_batch_full[m_batch_fill] = true;
+    m_batch_fill = other;
+    p_batch = &m_batches[other];
+  }
+  uint8_t *pos = p_batch->data + p_batch->len;
+  uint32_t now = enrf_millis();
+  memcpy(pos, &now, 4);
+  pos[4] = p_adv_report->peer_addr.addr_type;
+  memcpy(pos + 5, p_adv_report->peer_addr.addr, BLE_GAP_ADDR_LEN);
+  pos[11] = (p_adv_report->primary_phy & 0xF) | (p_adv_report->secondary_phy << 4);
+  pos[12] = (uint8_t)p_adv_report->rssi;
+  pos[13] = data_len & 0xFF;
+  pos[14] = data_len >> 8;
+  memcpy(pos + 15, p_adv_report->data.p_data, data_len);
+  p_batch->len += rec_len;
+  p_batch->count++;
+}
+
+//--------------------------------------------------------------------------
+
+static void batch_send() {
+  // Called from the main loop, the scan reports arrive in interrupt context
+  if (m_batch_flush) {
+    m_batch_flush = false;
+    CRITICAL_REGION_ENTER();
+    uint8_t other = m_batch_fill ^ 1;
+    if (m_batches[m_batch_fill].count && !m_batch_full[other]) {
+      m_batch_full[m_batch_fill] = true;
+      m_batch_fill = other;
+    }
+    CRITICAL_REGION_EXIT();
+  }
+  // The batch not being filled is the older one
+  uint8_t first = m_batch_fill + 1;
+  for (uint8_t n = 0; n < 2; n++) {
+    uint8_t i = (first + n) & 1;
+    if (!m_batch_full[i]) {
+      continue;
+    }
+    batch_t *p_batch = &m_batches[i];
+    uint16_t dropped;
+    CRITICAL_REGION_ENTER();
+    dropped = m_batch_dropped;
+    m_batch_dropped = 0;
+    CRITICAL_REGION_EXIT();
+    uint16_t header[] = {BATCH_MAGIC, p_batch->len - BATCH_HEADER_SIZE, m_batch_seq++, dropped};
+    memcpy(p_batch->data, header, sizeof(header));
+    p_batch->data[8] = p_batch->count;
+    // Frame ends with a xor checksum of the payload
+    uint8_t check = 0;
+    for (uint16_t j = BATCH_HEADER_SIZE; j < p_batch->len; j++) {
+      check ^= p_batch->data[j];
+    }
+    p_batch->data[p_batch->len] = check;
+    if (enrf_serial_write_data(p_batch->data, p_batch->len + 1) != NRF_SUCCESS) {
+      // Possibly truncated, the reports are counted as dropped in the next frame
+      CRITICAL_REGION_ENTER();
+      m_batch_dropped += p_batch->count;
+      CRITICAL_REGION_EXIT();
+    }
+    p_batch->len = BATCH_HEADER_SIZE;
+    p_batch->count = 0;
+    m_batch_full[i] = false;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void batch_timeout(void *p_context) {
+  m_batch_flush = true;
+}
+
+//--------------------------------------------------------------------------
+
+static void scan_bin() {
+  // Parameter format: flush_ms, 0 returns to text reports
+  uint32_t flush_ms = DEC_PARAM(0, 0);
+  static bool timer_created = false;
+  if (!timer_created) {
+    app_timer_create(&m_batch_timer, APP_TIMER_MODE_REPEATED, batch_timeout);
+    timer_created = true;
+  }
+  app_timer_stop(m_batch_timer);
+  CRITICAL_REGION_ENTER();
+  for (uint8_t i = 0; i < 2; i++) {
+    m_batches[i].len = BATCH_HEADER_SIZE;
+    m_batches[i].count = 0;
+    m_batch_full[i] = false;
+  }
+  m_batch_fill = 0;
+  m_batch_dropped = 0;
+  m_scan_bin = flush_ms > 0;
+  CRITICAL_REGION_EXIT();
+  if (m_scan_bin) {
+    app_timer_start(m_batch_timer, APP_TIMER_TICKS(flush_ms), NULL);
+  }
+  CMD_OK("");
+}
+
+//--------------------------------------------------------------------------
+
 static bool scan_response(ble_gap_evt_adv_report_t *p_adv_report) {
+  if (m_scan_bin) {
+    // Filtering is left to the host
+    batch_add(p_adv_report);
+    return false;
+  }
   // Build scan report
-  uint8_t name[32];
-  uint8_t name_len = enrf_adv_parse(p_adv_report, BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME,
-                                    BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME, name, sizeof(name));
-  name[name_len] = 0;
-  snprintf(m_char_buff, sizeof(m_char_buff), "%s;%s;", enrf_addr_to_str(&(p_adv_report->peer_addr)),
-           name);
-  uint8_t data[32];
-  uint8_t data_len = enrf_adv_parse(p_adv_report, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA,
-                                    BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, data, sizeof(data));
-  bytes_to_hex(data, data_len, m_char_buff + strlen(m_char_buff));
+  enrf_adv_index_t index;
+  uint8_t name_len, data_len;
+  enrf_adv_index(p_adv_report, &index);
+  const uint8_t *name = enrf_adv_index_find(&index, BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME,
+                                            BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME, &name_len);
+  snprintf(m_char_buff, sizeof(m_char_buff), "%s;%.*s;", enrf_addr_to_str(&(p_adv_report->peer_addr)),
+           MIN(name_len, 31), name ? (const char *)name : "");
+  const uint8_t *data = enrf_adv_index_find(&index, BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA,
+                                            BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA, &data_len);
+  bytes_to_hex((uint8_t *)data, MIN(data_len, 32), m_char_buff + strlen(m_char_buff));
   // Check for match
   char *match_pos = m_scan_match;
   bool show = *match_pos == 0;  // Empty match means all
@@ -160,7 +324,7 @@ static bool scan_response(ble_gap_evt_adv_report_t *p_adv_report) {
     match_pos += strlen(match_pos) + 1;
   }
   if (show) {
-    RESP_ASYNC("SCAN:%s;%d", (char *)m_char_buff, p_adv_report->rssi);
+    RESP_ASYNC("SCAN:%s;%d;%d", (char *)m_char_buff, p_adv_report->rssi, p_adv_report->primary_phy);
   }
   return m_scan_once && show;
 }
@@ -184,8 +348,48 @@ void discovery_handler(ble_db_discovery_evt_t *p_evt) {
 
 //--------------------------------------------------------------------------
 
+static void set_long_range(int pos) {
+  // Long range parameter overrides possible phy command settings when given
+  // 2 scans or connects on both 1M and coded PHY
+  if (m_params[pos] && *m_params[pos] == '2') {
+    enrf_phy_policy_t policy;
+    enrf_set_phy(false);
+    enrf_get_phy_policy(&policy);
+    policy.scan_phys = policy.conn_phys = BLE_GAP_PHY_1MBPS | BLE_GAP_PHY_CODED;
+    enrf_set_phy_policy(&policy);
+  } else if (m_params[pos] && *m_params[pos]) {
+    enrf_set_phy(BOOL_PARAM(pos));
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void phy() {
+  // Parameter format: adv_primary;adv_secondary;scan;connect;periph_link;central_link;adv_extended
+  // Values are BLE_GAP_PHY_* masks, 1: 1M, 2: 2M, 4: coded. Empty keeps the current value
+  enrf_phy_policy_t policy;
+  enrf_get_phy_policy(&policy);
+  uint8_t *fields[] = {&policy.adv_primary_phy, &policy.adv_secondary_phy, &policy.scan_phys,
+                       &policy.conn_phys, &policy.periph_link_phys, &policy.central_link_phys
+                      };
+  for (int i = 0; i < m_param_cnt && i < ARRAY_SIZE(fields); i++) {
+    if (*m_params[i]) {
+      *fields[i] = strtoul(m_params[i], NULL, 10);
+    }
+  }
+  if (m_param_cnt > 6 && *m_params[6]) {
+    policy.adv_extended = BOOL_PARAM(6);
+  }
+  enrf_set_phy_policy(&policy);
+  CMD_OK("%d;%d;%d;%d;%d;%d;%d", policy.adv_primary_phy, policy.adv_secondary_phy,
+         policy.scan_phys, policy.conn_phys, policy.periph_link_phys, policy.central_link_phys,
+         policy.adv_extended);
+}
+
+//--------------------------------------------------------------------------
+
 static void scan() {
-  // Parameter format: match_string;only_once;long_range;active;timeout
+  // Parameter format: match_string;only_once;long_range;active;timeout;report_ms
   if (!m_param_cnt) {
     VALIDATE_NRF(enrf_stop_scan());
   } else {
@@ -198,7 +402,9 @@ static void scan() {
       *(pos++) = 0;
     }
     m_scan_once = BOOL_PARAM(1);
-    enrf_set_phy(BOOL_PARAM(2));
+    set_long_range(2);
+    // Deduplicate on the device when a report interval is given
+    enrf_set_scan_dedup(m_params[5] && *m_params[5], DEC_PARAM(5, 0));
     VALIDATE_NRF(enrf_start_scan(scan_response, DEC_PARAM(4, 0), BOOL_PARAM(3)));
   }
 }
@@ -212,13 +418,16 @@ static void advertise() {
   } else {
     uint32_t timeout_s = DEC_PARAM(3, 0);
     uint32_t interval_ms = DEC_PARAM(4, 100);
-    enrf_set_phy(BOOL_PARAM(2));
+    set_long_range(2);
     if (*m_params[0] == '#') {
-      // Manufacturer data field
-      uint8_t data[32];
-      uint32_t len = hex_to_bytes(m_params[0] + 1, data, sizeof(data));
-      VALIDATE_NRF(enrf_start_advertise(BOOL_PARAM(1), *((uint16_t *)data), BLE_ADVDATA_NO_NAME,
-                                        data + 2, len - 2,
+      // Manufacturer data field, more than 31 bytes in total gives extended advertising
+      uint32_t len = hex_to_bytes(m_params[0] + 1, m_data_buff, ADV_DATA_SIZE);
+      if (len < 2) {
+        CMD_ERROR("Syntax error");
+        return;
+      }
+      VALIDATE_NRF(enrf_start_advertise(BOOL_PARAM(1), *((uint16_t *)m_data_buff),
+                                        BLE_ADVDATA_NO_NAME, m_data_buff + 2, len - 2,
                                         interval_ms, timeout_s, nus_data_received));
     } else {
       // Name field
@@ -234,6 +443,90 @@ static void advertise() {
 
 //--------------------------------------------------------------------------
 
+static void adv_policy() {
+  // Parameter format: fast_interval_ms;fast_duration_s;directed_reconnect
+  // Empty keeps the current value
+  enrf_adv_policy_t policy;
+  enrf_get_adv_policy(&policy);
+  if (m_param_cnt > 0 && *m_params[0]) {
+    policy.fast_interval_ms = DEC_PARAM(0, 0);
+  }
+  if (m_param_cnt > 1 && *m_params[1]) {
+    policy.fast_duration_s = DEC_PARAM(1, 0);
+  }
+  if (m_param_cnt > 2 && *m_params[2]) {
+    policy.directed_reconnect = BOOL_PARAM(2);
+  }
+  enrf_set_adv_policy(&policy);
+  CMD_OK("%lu;%lu;%d", policy.fast_interval_ms, policy.fast_duration_s,
+         policy.directed_reconnect);
+}
+
+//--------------------------------------------------------------------------
+
+static bool advdata_param(ble_advdata_t *p_advdata, ble_advdata_manuf_data_t *p_manuf_data) {
+  // Parameter format: #manuf_data|name
+  memset(p_advdata, 0, sizeof(*p_advdata));
+  if (*m_params[0] == '#') {
+    uint32_t len = hex_to_bytes(m_params[0] + 1, m_data_buff, ADV_DATA_SIZE);
+    if (len < 2) {
+      CMD_ERROR("Syntax error");
+      return false;
+    }
+    p_manuf_data->company_identifier = *((uint16_t *)m_data_buff);
+    p_manuf_data->data.p_data = m_data_buff + 2;
+    p_manuf_data->data.size = len - 2;
+    p_advdata->p_manuf_specific_data = p_manuf_data;
+  } else {
+    // The device name given with the advertise command
+    p_advdata->name_type = BLE_ADVDATA_FULL_NAME;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------------------
+
+static void scan_rsp() {
+  // Parameter format: #manuf_data|name
+  // Empty params clears the scan response
+  if (!m_param_cnt || !*m_params[0]) {
+    VALIDATE_NRF(enrf_set_scan_response(NULL));
+    return;
+  }
+  ble_advdata_t srdata;
+  ble_advdata_manuf_data_t manuf_data;
+  if (advdata_param(&srdata, &manuf_data)) {
+    VALIDATE_NRF(enrf_set_scan_response(&srdata));
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void adv_rotate() {
+  // Parameter format: #manuf_data|name;weight
+  // Empty params stops the rotation and clears the payloads
+  if (!m_param_cnt) {
+    enrf_adv_rotation_stop(true);
+    CMD_OK("");
+    return;
+  }
+  ble_advdata_t advdata;
+  ble_advdata_manuf_data_t manuf_data;
+  uint8_t slot;
+  if (!advdata_param(&advdata, &manuf_data)) {
+    return;
+  }
+  advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+  ret_code_t res = enrf_adv_rotation_add(&advdata, DEC_PARAM(1, 1), &slot);
+  if (res == NRF_SUCCESS) {
+    CMD_OK("%d", slot);
+  } else {
+    RESP_ERROR("%s nrf error: %lX", m_command, res);
+  }
+}
+
+//--------------------------------------------------------------------------
+
 static void add_uuid() {
   ble_uuid128_t base_uuid;
   ble_uuid_t service_uuid;
@@ -271,18 +564,28 @@ static void add_uuid() {
 
 //--------------------------------------------------------------------------
 
-static void connect() {
-  // Parameter format: mac_address;long_range;
-  ble_gap_addr_t addr = {0};
-  if (*m_params[0] == 'P') {
-    m_params[0]++;
-    addr.addr_type = BLE_GAP_ADDR_TYPE_PUBLIC;
+static bool parse_addr(const char *str, ble_gap_addr_t *addr) {
+  // Public addresses are prefixed with P
+  memset(addr, 0, sizeof(*addr));
+  if (*str == 'P') {
+    str++;
+    addr->addr_type = BLE_GAP_ADDR_TYPE_PUBLIC;
   } else {
-    addr.addr_type = BLE_GAP_ADDR_TYPE_RANDOM_STATIC;
+    addr->addr_type = BLE_GAP_ADDR_TYPE_RANDOM_STATIC;
   }
-  if (enrf_str_to_addr(m_params[0], &addr)) {
-    enrf_set_phy(BOOL_PARAM(1));
-    VALIDATE_NRF(enrf_connect_to(&addr, discovery_handler, nus_c_response));
+  return enrf_str_to_addr(str, addr);
+}
+
+//--------------------------------------------------------------------------
+
+static void connect() {
+  // Parameter format: mac_address;long_range;
+  // Address * connects to any device in the accept list
+  ble_gap_addr_t addr;
+  bool accept_list = strcmp(m_params[0], "*") == 0;
+  if (accept_list || parse_addr(m_params[0], &addr)) {
+    set_long_range(1);
+    VALIDATE_NRF(enrf_connect_to(accept_list ? NULL : &addr, discovery_handler, nus_c_response));
   } else {
     CMD_ERROR("Invalid mac address");
   }
@@ -290,13 +593,71 @@ static void connect() {
 
 //--------------------------------------------------------------------------
 
+static void accept_list() {
+  // Parameter format: mac_address|mac_address...;filter_scan
+  // Empty address list clears
+  ble_gap_addr_t addrs[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
+  uint8_t cnt = 0;
+  char *pos = m_param_cnt ? (char *)m_params[0] : "";
+  while (*pos) {
+    char *end = strchr(pos, '|');
+    if (end) {
+      *end = 0;
+    }
+    if (cnt == ARRAY_SIZE(addrs) || !parse_addr(pos, &addrs[cnt++])) {
+      CMD_ERROR("Invalid mac address list");
+      return;
+    }
+    pos = end ? end + 1 : pos + strlen(pos);
+  }
+  VALIDATE_NRF(enrf_set_accept_list(addrs, cnt, BOOL_PARAM(1)));
+}
+
+//--------------------------------------------------------------------------
+
 static void disconnect() {
-  VALIDATE_NRF(enrf_disconnect());
+  VALIDATE_NRF(enrf_disconnect(m_conn_handle));
+}
+
+//--------------------------------------------------------------------------
+
+static void link() {
+  // Parameter format: conn_handle
+  // Response format: current_handle;all,handles
+  if (m_param_cnt) {
+    uint16_t conn_handle = strtoul(m_params[0], NULL, 10);
+    if (!enrf_is_connected(conn_handle)) {
+      CMD_ERROR("Not connected");
+      return;
+    }
+    m_conn_handle = conn_handle;
+  }
+  uint16_t handles[NRF_SDH_BLE_TOTAL_LINK_COUNT];
+  uint8_t cnt = enrf_get_conn_handles(handles, ARRAY_SIZE(handles));
+  char list[64] = "";
+  for (uint8_t i = 0; i < cnt; i++) {
+    snprintf(list + strlen(list), sizeof(list) - strlen(list), "%s%d", i ? "," : "", handles[i]);
+  }
+  CMD_OK("%d;%s", m_conn_handle, list);
+}
+
+//--------------------------------------------------------------------------
+
+static void status() {
+  // Response format: att_mtu;tx_octets;rx_octets;tx_phy;rx_phy;interval;latency;timeout
+  enrf_link_info_t info;
+  if (enrf_get_link_info(m_conn_handle, &info) == NRF_SUCCESS) {
+    CMD_OK("%d;%d;%d;%d;%d;%d;%d;%d", info.att_mtu, info.max_tx_octets, info.max_rx_octets,
+           info.tx_phy, info.rx_phy, info.conn_params.max_conn_interval,
+           info.conn_params.slave_latency, info.conn_params.conn_sup_timeout);
+  } else {
+    CMD_ERROR("Not connected");
+  }
 }
 
 //--------------------------------------------------------------------------
 
-static void write(uint8_t op) {
+static void write_cmd() {
   uint16_t len;
   uint16_t handle = strtoul(m_params[0], NULL, 16);
   bool ok = handle > 0;
@@ -306,7 +667,8 @@ static void write(uint8_t op) {
   }
   if (ok) {
     ret_code_t res;
-    while ((res = enrf_write_char(op, handle, m_data_buff, len)) == NRF_ERROR_RESOURCES) {
+    while ((res = enrf_write_char(m_conn_handle, BLE_GATT_OP_WRITE_CMD, handle, m_data_buff,
+                                  len)) == NRF_ERROR_RESOURCES) {
       // Handle busy state
       sd_app_evt_wait();
     }
@@ -318,6 +680,175 @@ static void write(uint8_t op) {
 
 //--------------------------------------------------------------------------
 
+static void gatt_response(uint16_t conn_handle, uint16_t char_handle, uint16_t gatt_status,
+                          const uint8_t *data, uint16_t length, void *p_context) {
+  // Context is the response name
+  if (gatt_status == BLE_GATT_STATUS_SUCCESS) {
+    RESP_ASYNC("%s:%X,%s;%d", (const char *)p_context, char_handle, hex_str((uint8_t *)data, length),
+               conn_handle);
+  } else {
+    RESP_ASYNC("GATT_ERROR:%X,%X;%d", char_handle, gatt_status, conn_handle);
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static uint8_t get_links(int pos, uint16_t *handles) {
+  // Comma separated link handles or * for all links. Default is the current link
+  const char *links = m_params[pos];
+  if (!links || !*links) {
+    handles[0] = m_conn_handle;
+    return 1;
+  }
+  if (*links == '*') {
+    return MIN(enrf_get_conn_handles(handles, NRF_SDH_BLE_TOTAL_LINK_COUNT),
+               NRF_SDH_BLE_TOTAL_LINK_COUNT);
+  }
+  uint8_t cnt = 0;
+  while (*links && cnt < NRF_SDH_BLE_TOTAL_LINK_COUNT) {
+    char *end;
+    handles[cnt++] = strtoul(links, &end, 10);
+    links = *end ? end + 1 : end;
+  }
+  return cnt;
+}
+
+//--------------------------------------------------------------------------
+
+static void gatt_request(char type) {
+  // Parameter format: handle[;value_in_hex];links
+  // Queued on all specified links at once, responses are given per link
+  uint16_t handles[NRF_SDH_BLE_TOTAL_LINK_COUNT];
+  uint16_t char_handle = strtoul(m_params[0], NULL, 16);
+  uint16_t len = 0;
+  if (type == 'w') {
+    len = hex_to_bytes(m_params[1], m_data_buff, sizeof(m_data_buff));
+  }
+  if (!char_handle || (type == 'w' && !len)) {
+    CMD_ERROR("Syntax error");
+    return;
+  }
+  uint8_t cnt = get_links(type == 'w' ? 2 : 1, handles);
+  ret_code_t res = NRF_SUCCESS;
+  for (uint8_t i = 0; i < cnt && res == NRF_SUCCESS; i++) {
+    if (type == 'r') {
+      res = enrf_gatt_read(handles[i], char_handle, gatt_response, "READ_RESP");
+    } else if (type == 'w') {
+      res = enrf_gatt_write(handles[i], char_handle, m_data_buff, len, gatt_response, "WRITE_RESP");
+    } else {
+      res = enrf_gatt_notif_enable(handles[i], char_handle, true, gatt_response, "WRITE_RESP");
+    }
+  }
+  VALIDATE_NRF(res);
+}
+
+//--------------------------------------------------------------------------
+
+static void l2cap_event(uint16_t conn_handle, uint16_t local_cid, enrf_l2cap_evt_t evt,
+                        uint16_t param) {
+  switch (evt) {
+    case ENRF_L2CAP_EVT_CONNECTED:
+      RESP_ASYNC("L2CAP_CONNECTED:%d,%d;%d", local_cid, param, conn_handle);
+      break;
+    case ENRF_L2CAP_EVT_REFUSED:
+      RESP_ASYNC("L2CAP_REFUSED:%X;%d", param, conn_handle);
+      break;
+    case ENRF_L2CAP_EVT_RELEASED:
+      RESP_ASYNC("L2CAP_RELEASED:%d;%d", local_cid, conn_handle);
+      if (local_cid == m_stream.local_cid && conn_handle == m_stream.conn_handle) {
+        m_stream.left = 0;
+      }
+      break;
+    case ENRF_L2CAP_EVT_TX_DONE:
+      if (local_cid == m_stream.local_cid && conn_handle == m_stream.conn_handle &&
+          !m_stream.left && !param && m_stream.sdu_size) {
+        m_stream.sdu_size = 0;
+        RESP_ASYNC("L2CAP_STREAM_DONE:%d;%d", local_cid, conn_handle);
+      }
+      break;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void l2cap_data(uint16_t conn_handle, uint16_t local_cid, uint8_t *data, uint16_t length) {
+  m_l2cap_rx_bytes += length;
+  m_l2cap_rx_sdus++;
+  if (!m_l2cap_quiet) {
+    RESP_ASYNC("L2CAP:%d,%s;%d", local_cid, hex_str(data, length), conn_handle);
+  }
+  enrf_l2cap_rx_release(conn_handle, local_cid, data);
+}
+
+//--------------------------------------------------------------------------
+
+static void l2cap_stream_fill() {
+  // Keep the transmit buffers of the streamed channel busy
+  while (m_stream.left && enrf_l2cap_tx_free(m_stream.conn_handle, m_stream.local_cid)) {
+    uint16_t len = MIN(m_stream.left, m_stream.sdu_size);
+    if (enrf_l2cap_send(m_stream.conn_handle, m_stream.local_cid, m_stream_buff, len) != NRF_SUCCESS) {
+      break;
+    }
+    m_stream.left -= len;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void l2cap_stream() {
+  // Parameter format: cid;total_bytes;sdu_size
+  uint16_t local_cid = strtoul(m_params[0], NULL, 10);
+  uint32_t bytes = DEC_PARAM(1, 0);
+  uint16_t sdu_size = MIN(DEC_PARAM(2, L2CAP_STREAM_SDU_MAX), L2CAP_STREAM_SDU_MAX);
+  if (!enrf_l2cap_tx_free(m_conn_handle, local_cid)) {
+    CMD_ERROR("Channel not ready");
+    return;
+  }
+  // Counting pattern for verification on the receiving side
+  for (uint16_t i = 0; i < sizeof(m_stream_buff); i++) {
+    m_stream_buff[i] = i;
+  }
+  m_stream.conn_handle = m_conn_handle;
+  m_stream.local_cid = local_cid;
+  m_stream.sdu_size = sdu_size;
+  m_stream.left = bytes;
+  CMD_OK("");
+}
+
+//--------------------------------------------------------------------------
+
+static void l2cap_command() {
+  uint16_t local_cid;
+  if (CMD_EQ("l2cap_listen")) {
+    // Parameter format: psm;quiet
+    m_l2cap_quiet = BOOL_PARAM(1);
+    enrf_l2cap_register(m_param_cnt ? strtoul(m_params[0], NULL, 16) : 0, l2cap_data, l2cap_event);
+    CMD_OK("");
+  } else if (CMD_EQ("l2cap_open") && m_param_cnt) {
+    ret_code_t res = enrf_l2cap_open(m_conn_handle, strtoul(m_params[0], NULL, 16), &local_cid);
+    if (res == NRF_SUCCESS) {
+      CMD_OK("%d", local_cid);
+    } else {
+      RESP_ERROR("%s nrf error: %lX", m_command, res);
+    }
+  } else if (CMD_EQ("l2cap_close") && m_param_cnt) {
+    VALIDATE_NRF(enrf_l2cap_close(m_conn_handle, strtoul(m_params[0], NULL, 10)));
+  } else if (CMD_EQ("l2cap_send") && m_param_cnt > 1) {
+    uint16_t len = hex_to_bytes(m_params[1], m_data_buff, sizeof(m_data_buff));
+    VALIDATE_NRF(enrf_l2cap_send(m_conn_handle, strtoul(m_params[0], NULL, 10), m_data_buff, len));
+  } else if (CMD_EQ("l2cap_stream") && m_param_cnt > 1) {
+    l2cap_stream();
+  } else if (CMD_EQ("l2cap_rx")) {
+    // Response format: bytes;sdus, counters are reset
+    CMD_OK("%lu;%lu", m_l2cap_rx_bytes, m_l2cap_rx_sdus);
+    m_l2cap_rx_bytes = m_l2cap_rx_sdus = 0;
+  } else {
+    RESP_ERROR("Invalid command: \"%s\" Type help for listing", m_command);
+  }
+}
+
+//--------------------------------------------------------------------------
+
 static void led() {
   unsigned long led_no = strtoul(m_params[0], NULL, 10);
   SET_LED(led_no, strtoul(m_params[1], NULL, 10));
@@ -353,26 +884,81 @@ const char *m_help =
   "  vers                      Show version\n"
   "  tx_pow                    Set tx power\n"
   "    param pow_dbm\n"
+  "  phy                       Set phy policy, 1: 1M, 2: 2M, 4: coded\n"
+  "    params: adv_primary;adv_secondary;scan;connect;periph_link;central_link;adv_extended\n"
+  "    Empty param keeps current value. Long range params in other commands override\n"
+  "  phy_update                Request phy change on current link\n"
+  "    param: phys\n"
   "  scan                      Start or stop scan\n"
-  "    params: match_string;only_once;long_range;active;timeout\n"
+  "    params: match_string;only_once;long_range;active;timeout;report_ms\n"
+  "    report_ms reports each device on data change and at most this often, 0 only on change\n"
+  "    long_range 2 scans 1M and coded PHY in the same session\n"
   "    Empty params stops scan\n"
+  "    Report format: #SCAN:mac_address;name;manuf_data;rssi;phy\n"
+  "  scan_bin                  Send scan reports as binary frames, batched until full or flushed\n"
+  "    param: flush_ms, 0 or empty returns to text reports\n"
+  "    Frame: A5 5A len(2) seq(2) dropped(2) count(1) reports xor_check(1), little endian\n"
+  "    Report: time_ms(4) addr_type(1) addr(6) phys(1) rssi(1) data_len(2) data\n"
+  "  adv_chains                Show extended advertising reassembly statistics\n"
+  "    response: complete;truncated;dropped\n"
   "  advertise                 Start advertisement\n"
   "    params: name|manuf_data;connectable;long_range;timeout_s;interval_ms\n"
   "    Empty params stops advertisings\n"
+  "    Manufacturer data over 31 bytes, up to 255, gives extended advertising\n"
+  "  adv_policy                Set fast advertising phase and directed reconnect\n"
+  "    params: fast_interval_ms;fast_duration_s;directed_reconnect\n"
+  "    The advertise interval is used after the fast phase, the timeout covers both\n"
+  "  scan_rsp                  Set scan response data, legacy advertising only\n"
+  "    param: #manuf_data|name, empty clears\n"
+  "  adv_rotate                Add payload for advertising rotation\n"
+  "    params: #manuf_data|name;weight\n"
+  "    response: slot. Empty params stops the rotation and clears the payloads\n"
+  "  adv_rotate_start          Start rotating payloads while advertising\n"
+  "    param: period_ms\n"
+  "  adv_update                Update manufacturer data while advertising\n"
+  "    param: data_in_hex, without company id\n"
   "  connect                   Connect to given address\n"
   "    params: mac_address;long_range\n"
+  "    Address * connects to the first found device in the accept list\n"
+  "  accept                    Set accept list filtered by the link layer\n"
+  "    params: mac_address|mac_address...;filter_scan\n"
+  "    Empty list clears. filter_scan 1 only reports listed devices when scanning\n"
   "  cancel_connect\n"
-  "  disconnect\n"
+  "  disconnect                Disconnect current link\n"
+  "  link                      Show or select current link for connection commands\n"
+  "    param: conn_handle\n"
+  "    response: current_handle;all,handles\n"
+  "  status                    Show negotiated link properties\n"
+  "    response: att_mtu;tx_octets;rx_octets;tx_phy;rx_phy;interval;latency;timeout\n"
+  "  conn_profile              Select connection parameters, applied immediately\n"
+  "    param: 0: default, 1: low latency, 2: throughput, 3: low power\n"
   "  add_uid                   Add service or charact uuid\n"
   "    param: uuid_in_hex\n"
   "  notify                    Enable notifications\n"
-  "    param: handle\n"
+  "    param: handle;links\n"
   "  write_cmd                 Write charact value\n"
   "    param: handle;value_in_hex\n"
   "  write                     Write charact value with response\n"
-  "    param: handle;value_in_hex\n"
+  "    param: handle;value_in_hex;links\n"
   "  read                      Read charact value\n"
-  "    param: handle\n"
+  "    param: handle;links\n"
+  "    links: comma separated link handles or * for all, default is current link\n"
+  "    response: #READ_RESP|WRITE_RESP:handle,value;link or #GATT_ERROR:handle,status;link\n"
+  "  l2cap_listen              Accept l2cap channels, listen events and data\n"
+  "    params: psm_in_hex;quiet\n"
+  "    Quiet only counts received data. Event format: #L2CAP:cid,value;link\n"
+  "  l2cap_open                Open l2cap channel on current link\n"
+  "    param: psm_in_hex\n"
+  "    response: cid, followed by #L2CAP_CONNECTED:cid,peer_mtu;link or #L2CAP_REFUSED\n"
+  "  l2cap_close               Close l2cap channel\n"
+  "    param: cid\n"
+  "  l2cap_send                Send l2cap data\n"
+  "    params: cid;value_in_hex\n"
+  "  l2cap_stream              Stream counting pattern on l2cap channel\n"
+  "    params: cid;total_bytes;sdu_size\n"
+  "    Ends with #L2CAP_STREAM_DONE:cid;link\n"
+  "  l2cap_rx                  Show and reset received l2cap data statistics\n"
+  "    response: bytes;sdus\n"
   "  nusc                      Write nus client string\n"
   "    param: string\n"
   "  restart                   Restart unit with possible dfu mode\n"
@@ -381,7 +967,6 @@ const char *m_help =
   "  led                       Turn on or off led\n"
   "    params: led_no;on\n"
   "";
-#define CMD_EQ(str) ((strcasecmp(m_command, str) == 0))
 
 static void handle_command() {
   m_param_cnt = 0;
@@ -406,28 +991,60 @@ static void handle_command() {
   } else if (CMD_EQ("tx_pow") && m_param_cnt) {
     enrf_set_tx_power(strtoul(m_params[0], NULL, 10));
     CMD_OK("");
+  } else if (CMD_EQ("phy")) {
+    phy();
+  } else if (CMD_EQ("phy_update") && m_param_cnt) {
+    VALIDATE_NRF(enrf_phy_update(m_conn_handle, strtoul(m_params[0], NULL, 10)));
   } else if (CMD_EQ("scan")) {
     scan();
+  } else if (CMD_EQ("scan_bin")) {
+    scan_bin();
+  } else if (CMD_EQ("adv_chains")) {
+    enrf_adv_chain_stats_t stats;
+    enrf_get_adv_chain_stats(&stats);
+    CMD_OK("%lu;%lu;%lu", stats.complete, stats.truncated, stats.dropped);
   } else if (CMD_EQ("advertise")) {
     advertise();
+  } else if (CMD_EQ("adv_policy")) {
+    adv_policy();
+  } else if (CMD_EQ("scan_rsp")) {
+    scan_rsp();
+  } else if (CMD_EQ("adv_rotate")) {
+    adv_rotate();
+  } else if (CMD_EQ("adv_rotate_start") && m_param_cnt) {
+    VALIDATE_NRF(enrf_adv_rotation_start(strtoul(m_params[0], NULL, 10)));
+  } else if (CMD_EQ("adv_update") && m_param_cnt) {
+    // Company id is kept from the advertise command
+    uint32_t len = hex_to_bytes(m_params[0], m_data_buff, ADV_DATA_SIZE - 2);
+    VALIDATE_NRF(enrf_update_advertise_data(m_data_buff, len));
   } else if (CMD_EQ("connect") && m_param_cnt) {
     connect();
+  } else if (CMD_EQ("accept")) {
+    accept_list();
   } else if (CMD_EQ("cancel_connect")) {
     VALIDATE_NRF(sd_ble_gap_connect_cancel());
   } else if (CMD_EQ("disconnect")) {
     disconnect();
+  } else if (CMD_EQ("link")) {
+    link();
+  } else if (CMD_EQ("status")) {
+    status();
+  } else if (CMD_EQ("conn_profile") && m_param_cnt) {
+    VALIDATE_NRF(enrf_set_conn_profile(strtoul(m_params[0], NULL, 10)));
   } else if (CMD_EQ("add_uuid") && m_param_cnt) {
     add_uuid();
   } else if (CMD_EQ("notify") && m_param_cnt) {
-    VALIDATE_NRF(enrf_enable_char_notif(strtoul(m_params[0], NULL, 16), true));
+    gatt_request('n');
   } else if (CMD_EQ("write_cmd") && m_param_cnt > 1) {
-    write(BLE_GATT_OP_WRITE_CMD);
+    write_cmd();
   } else if (CMD_EQ("write") && m_param_cnt > 1) {
-    write(BLE_GATT_OP_WRITE_REQ);
+    gatt_request('w');
   } else if (CMD_EQ("read") && m_param_cnt) {
-    VALIDATE_NRF(enrf_read_char(strtoul(m_params[0], NULL, 16)));
+    gatt_request('r');
+  } else if (strncasecmp(m_command, "l2cap_", 6) == 0) {
+    l2cap_command();
   } else if (CMD_EQ("nusc")) {
-    VALIDATE_NRF(enrf_nus_c_string_send(m_params[0]));
+    VALIDATE_NRF(enrf_nus_c_string_send(m_conn_handle, m_params[0]));
   } else if (CMD_EQ("restart")) {
     enrf_restart(BOOL_PARAM(0));
   } else if (CMD_EQ("mac")) {
@@ -455,10 +1072,14 @@ static void startup() {
 int main() {
   enrf_init("ble_tool", on_ble_evt);
   enrf_serial_enable(true);
+  // Events for outgoing channels, incoming ones are refused until l2cap_listen
+  enrf_l2cap_register(0, l2cap_data, l2cap_event);
   bsp_init(BSP_INIT_BUTTONS | BSP_INIT_LEDS, bsp_event_handler);
   startup();
   while (true) {
     enrf_wait_for_event();
+    l2cap_stream_fill();
+    batch_send();
     if (enrf_serial_read(m_command, sizeof(m_command))) {
       handle_command();
     }
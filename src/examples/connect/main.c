@@ -22,15 +22,17 @@
 
 enum { IDLE, CONNECT, DISCONNECT } m_state = IDLE;
 ble_gap_addr_t m_client_addr;
+uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID;
 
-void nus_c_rx_cb(uint8_t *data, uint32_t length) {
+void nus_c_rx_cb(uint16_t conn_handle, uint8_t *data, uint32_t length) {
   if (data) {
     static char str[100];
     strlcpy(str, (const char *)data, MIN(sizeof(str), length + 1));
     NRF_LOG_INFO("Response: %s", str);
+    m_conn_handle = conn_handle;
     m_state = DISCONNECT;
   } else if (length == 1) {
-    enrf_nus_c_string_send(COMMAND);
+    enrf_nus_c_string_send(conn_handle, COMMAND);
   }
 }
 
@@ -82,7 +84,7 @@ int main() {
       enrf_connect_to(&m_client_addr, NULL, nus_c_rx_cb);
     } else if (m_state == DISCONNECT) {
       m_state = IDLE;
-      enrf_disconnect();
+      enrf_disconnect(m_conn_handle);
     }
   }
 }
\ No newline at end of file
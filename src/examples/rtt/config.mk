@@ -1,3 +1,4 @@
 
 UART_LOG = 0
-
+# Command input via rtt, started with make monitor
+ENRF_SERIAL = rtt
@@ -3,6 +3,7 @@
 // template
 //
 // Simple RTT input output example
+// Commands are received via enrf_serial on its own RTT channel, see config.mk
 //
 // This file is part of easy_nrf52
 // License: LGPL 2.1
@@ -14,7 +15,6 @@
 //====================================================================================
 
 #include <enrf.h>
-#include <SEGGER_RTT.h>
 
 #define USED_LED BSP_BOARD_LED_0
 
@@ -35,14 +35,12 @@ int main() {
   static char incoming[50] = {0};
   enrf_init("rtt example", NULL);
   bsp_init(BSP_INIT_LEDS, NULL);
+  enrf_serial_enable(true);
   NRF_LOG_INFO("rtt example started");
   while (true) {
-    if (SEGGER_RTT_HasData(0) != 0) {
-      unsigned int read_cnt = SEGGER_RTT_Read(0, incoming, sizeof(incoming) - 1);
-      incoming[read_cnt] = 0;
+    if (enrf_serial_read(incoming, sizeof(incoming))) {
       handle_incoming(incoming);
-    } else {
-      enrf_delay_ms(100);
     }
+    enrf_wait_for_event();
   }
 }
\ No newline at end of file
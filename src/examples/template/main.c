@@ -19,24 +19,24 @@
 #define ADV_INTERVAL_MS 100
 #define USED_LED BSP_BOARD_LED_0
 
-bool nus_data_received(uint8_t *data, uint32_t length) {
+bool nus_data_received(uint16_t conn_handle, uint8_t *data, uint32_t length) {
   // Data received from Nordic UART service, assume it's a command string
   char str[20];
   bool taken = true;
   strlcpy(str, (const char *)data, MIN(sizeof(str), length + 1));
   if (strcasestr(str, "Hello")) {
-    enrf_nus_string_send("Hello from enrf template");
+    enrf_nus_string_send(conn_handle, "Hello from enrf template");
   } else if (strcasestr(str, "led")) {
     bsp_board_led_invert(USED_LED);
     snprintf(str, sizeof(str), "LED is %s", bsp_board_led_state_get(USED_LED) ? "on" : "off");
-    enrf_nus_string_send(str);
+    enrf_nus_string_send(conn_handle, str);
   } else if (strcasestr(str, "DATA")) {
     // Send raw data
     uint8_t buff[256];
     for (int i = 0; i < sizeof(buff); i++) {
       buff[i] = i;
     }
-    enrf_nus_data_send(buff, sizeof(buff));
+    enrf_nus_data_send(conn_handle, buff, sizeof(buff));
   } else {
     // Propagate to common command handler
     taken = false;
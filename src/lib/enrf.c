@@ -14,8 +14,9 @@
 //
 //====================================================================================
 
-#if defined(ENRF_SERIAL_USB) && defined(ENRF_SERIAL_UART)
-#error Both usb and uart can not be used for enrf_serial
+#if defined(ENRF_SERIAL_USB) + defined(ENRF_SERIAL_UART) + defined(ENRF_SERIAL_UARTE) + \
+    defined(ENRF_SERIAL_RTT) > 1
+#error Only one of usb, uart, uarte and rtt can be used for enrf_serial
 #endif
 
 #define NRF_LOG_MODULE_NAME enrf
@@ -38,6 +39,10 @@ NRF_LOG_MODULE_REGISTER();
 #include "nrf_log_ctrl.h"
 #include "nrf_log_default_backends.h"
 
+#ifdef ENRF_GATT_CACHE
+# include "fds.h"
+#endif
+
 #ifdef ENRF_SERIAL_USB
 # include "app_usbd.h"
 # include "app_usbd_cdc_acm.h"
@@ -45,7 +50,11 @@ NRF_LOG_MODULE_REGISTER();
 # include "app_usbd_serial_num.h"
 # include "app_usbd_string_desc.h"
 
-#elif defined(ENRF_SERIAL_UART)
+#elif defined(ENRF_SERIAL_UARTE)
+# include "nrf_libuarte_async.h"
+
+#elif defined(ENRF_SERIAL_RTT)
+# include "SEGGER_RTT.h"
 #endif
 
 #if BLE_DFU_ENABLED == 1
@@ -59,24 +68,153 @@ NRF_LOG_MODULE_REGISTER();
 #define APP_BLE_CONN_CFG_TAG            1
 #define APP_BLE_OBSERVER_PRIO           3
 
+// Size of the NUS server and client transmit queues, must be powers of two
+#ifndef ENRF_NUS_TX_QUEUE_SIZE
+#define ENRF_NUS_TX_QUEUE_SIZE          1024
+#endif
+#ifndef ENRF_NUS_C_TX_QUEUE_SIZE
+#define ENRF_NUS_C_TX_QUEUE_SIZE        1024
+#endif
+STATIC_ASSERT(IS_POWER_OF_TWO(ENRF_NUS_TX_QUEUE_SIZE), "NUS tx queue size must be a power of two");
+STATIC_ASSERT(IS_POWER_OF_TWO(ENRF_NUS_C_TX_QUEUE_SIZE), "NUS client tx queue size must be a power of two");
+
+// Default link configuration, normally set via make variables
+#ifndef ENRF_EVENT_LENGTH
+#define ENRF_EVENT_LENGTH               NRF_SDH_BLE_GAP_EVENT_LENGTH
+#endif
+#ifndef ENRF_HVN_QUEUE_SIZE
+#define ENRF_HVN_QUEUE_SIZE             1
+#endif
+#ifndef ENRF_WRITE_CMD_QUEUE_SIZE
+#define ENRF_WRITE_CMD_QUEUE_SIZE       1
+#endif
+#ifndef ENRF_CONN_EVT_EXT
+#define ENRF_CONN_EVT_EXT               1
+#endif
+
+// Discovered services per peer kept in the GATT cache
+#ifndef ENRF_GATT_CACHE_MAX_SRV
+#define ENRF_GATT_CACHE_MAX_SRV         4
+#endif
+#define GATT_CACHE_FILE_ID              0x0EC0
+#define GATT_CACHE_REC_KEY              0x0EC1
+#define UUID_DATABASE_HASH              0x2B2A
+#define DATABASE_HASH_LEN               16
+
+// L2CAP connection oriented channels per link, none unless set via make variables
+#ifndef ENRF_L2CAP_CHANNELS
+#define ENRF_L2CAP_CHANNELS             0
+#endif
+// Max SDU size, and the number of SDU buffers per channel in each direction
+#ifndef ENRF_L2CAP_MTU
+#define ENRF_L2CAP_MTU                  512
+#endif
+#ifndef ENRF_L2CAP_RX_BUFS
+#define ENRF_L2CAP_RX_BUFS              2
+#endif
+#ifndef ENRF_L2CAP_TX_BUFS
+#define ENRF_L2CAP_TX_BUFS              2
+#endif
+// PDU payload size, a full link layer packet minus the L2CAP header
+#ifndef ENRF_L2CAP_MPS
+#define ENRF_L2CAP_MPS                  (NRF_SDH_BLE_GAP_DATA_LENGTH - 4)
+#endif
+// Credits kept by the peer while there is a free receive buffer, enough for a complete SDU
+#ifndef ENRF_L2CAP_CREDITS
+#define ENRF_L2CAP_CREDITS              ((ENRF_L2CAP_MTU + 2 + ENRF_L2CAP_MPS - 1) / ENRF_L2CAP_MPS)
+#endif
+
+// Devices tracked by the scan report deduplication, must be a power of two
+#ifndef ENRF_SCAN_DEDUP_SIZE
+#define ENRF_SCAN_DEDUP_SIZE            64
+#endif
+STATIC_ASSERT(IS_POWER_OF_TWO(ENRF_SCAN_DEDUP_SIZE), "Scan dedup size must be a power of two");
+// Slots searched from the hashed position before evicting the least recently seen one
+#define SCAN_DEDUP_PROBES               8
+
+// Extended advertising data chains reassembled in parallel, and their max size
+#ifndef ENRF_ADV_CHAIN_BUFS
+#define ENRF_ADV_CHAIN_BUFS             2
+#endif
+#ifndef ENRF_ADV_CHAIN_SIZE
+#define ENRF_ADV_CHAIN_SIZE             BLE_GAP_SCAN_BUFFER_EXTENDED_MAX
+#endif
+
+// Pre-encoded payloads for advertising rotation
+#ifndef ENRF_ADV_ROTATION_SLOTS
+#define ENRF_ADV_ROTATION_SLOTS         4
+#endif
+
+// Delays for the connection parameter negotiation as peripheral
+#ifndef ENRF_CONN_PARAMS_FIRST_DELAY_MS
+#define ENRF_CONN_PARAMS_FIRST_DELAY_MS 100
+#endif
+#ifndef ENRF_CONN_PARAMS_NEXT_DELAY_MS
+#define ENRF_CONN_PARAMS_NEXT_DELAY_MS  5000
+#endif
+
 // Global variables
 BLE_NUS_DEF(m_nus, NRF_SDH_BLE_TOTAL_LINK_COUNT);
-BLE_NUS_C_DEF(m_ble_nus_c);
+BLE_NUS_C_ARRAY_DEF(m_ble_nus_c, NRF_SDH_BLE_TOTAL_LINK_COUNT);
 NRF_BLE_GATT_DEF(m_gatt);
-NRF_BLE_QWR_DEF(m_qwr);
+NRF_BLE_QWRS_DEF(m_qwr, NRF_SDH_BLE_TOTAL_LINK_COUNT);
 #if SDK_VERSION >= 17
 NRF_BLE_GQ_DEF(m_ble_gatt_queue, /**< BLE GATT Queue instance. */
-               NRF_SDH_BLE_CENTRAL_LINK_COUNT,
+               NRF_SDH_BLE_TOTAL_LINK_COUNT,
                NRF_BLE_GQ_QUEUE_SIZE);
+#define GATT_REQ_QUEUE_SIZE NRF_BLE_GQ_QUEUE_SIZE
+#else
+#define GATT_REQ_QUEUE_SIZE 1
 #endif
 
 static ble_gap_adv_params_t m_adv_params;
 static uint8_t m_adv_handle = BLE_GAP_ADV_SET_HANDLE_NOT_SET;
-static uint8_t m_enc_advdata[BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+// Advertising runs in phases, each ended by the softdevice duration
+typedef enum {
+  ADV_PHASE_DIRECTED,
+  ADV_PHASE_FAST,
+  ADV_PHASE_SLOW
+} adv_phase_t;
+static adv_phase_t m_adv_phase = ADV_PHASE_SLOW;
+static uint32_t m_adv_interval_ms = 0;
+static uint32_t m_adv_timeout_s = 0;
+// Central lost at the last disconnect, target for directed advertising
+static ble_gap_addr_t m_adv_peer_addr;
+// Encoded data is double buffered, updates are encoded into the buffer not used by the softdevice
+// Up to 255 bytes with extended advertising, 31 otherwise
+#define ADV_DATA_MAX BLE_GAP_ADV_SET_DATA_SIZE_EXTENDED_MAX_SUPPORTED
+static uint8_t m_enc_advdata[2][ADV_DATA_MAX];
+static uint8_t m_enc_adv_index = 0;
+static uint16_t m_enc_adv_len = 0;
+static bool m_adv_extended = false;
+// Scan response data, double buffered the same way. Only used with legacy advertising
+static uint8_t m_enc_srdata[2][BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+static uint8_t m_enc_sr_index = 0;
+static ble_data_t m_scan_rsp = {.p_data = NULL, .len = 0};
+// The softdevice requires new buffers for both advertising and scan response data when
+// updated while advertising. Live updates are copied here, alternating between the two
+static uint8_t m_air_advdata[2][ADV_DATA_MAX];
+static uint8_t m_air_srdata[2][BLE_GAP_ADV_SET_DATA_SIZE_MAX];
+static uint8_t m_air_index = 0;
+// Advertising rotation, slot data is encoded once and copied on air when rotated
+typedef struct {
+  uint8_t  weight;   // Rotation periods on air, 0 for unused slot
+  uint16_t len;
+  uint8_t  data[ADV_DATA_MAX];
+} adv_slot_t;
+static adv_slot_t m_adv_slots[ENRF_ADV_ROTATION_SLOTS];
+static uint8_t m_adv_slot_current;
+static uint8_t m_adv_slot_left;
+static bool m_adv_slot_on_air = false;
+APP_TIMER_DEF(m_adv_rotation_timer);
+static bool m_adv_rotation_created = false;
+static ble_advdata_name_type_t m_adv_name_type;
+static uint8_t m_adv_flags;
+static uint16_t m_adv_company_id;
 static ble_gap_adv_data_t m_adv_data = {
   .adv_data = {
-    .p_data = m_enc_advdata,
-    .len = sizeof(m_enc_advdata)
+    .p_data = m_enc_advdata[0],
+    .len = ADV_DATA_MAX
   },
   .scan_rsp_data = {
     .p_data = NULL,
@@ -84,6 +222,58 @@ static ble_gap_adv_data_t m_adv_data = {
   }
 };
 
+static enrf_link_config_t m_link_config = {
+  .event_length = ENRF_EVENT_LENGTH,
+  .hvn_queue_size = ENRF_HVN_QUEUE_SIZE,
+  .write_cmd_queue_size = ENRF_WRITE_CMD_QUEUE_SIZE,
+  .conn_evt_ext = ENRF_CONN_EVT_EXT
+};
+
+static enrf_phy_policy_t m_phy_policy = {
+  .adv_primary_phy = BLE_GAP_PHY_1MBPS,
+  .adv_secondary_phy = BLE_GAP_PHY_1MBPS,
+  .scan_phys = BLE_GAP_PHY_1MBPS,
+  .scan_extended = false,
+  .adv_extended = false,
+  .conn_phys = BLE_GAP_PHY_1MBPS,
+  .periph_link_phys = BLE_GAP_PHY_AUTO,
+  .central_link_phys = BLE_GAP_PHY_AUTO
+};
+
+static enrf_adv_policy_t m_adv_policy = {
+  .fast_interval_ms = 0,
+  .fast_duration_s = 0,
+  .directed_reconnect = false
+};
+
+static const ble_gap_conn_params_t m_conn_profiles[] = {
+  [ENRF_CONN_PROFILE_DEFAULT] = {
+    MSEC_TO_UNITS(20, UNIT_1_25_MS),
+    MSEC_TO_UNITS(75, UNIT_1_25_MS),
+    0,
+    MSEC_TO_UNITS(4000, UNIT_10_MS)
+  },
+  [ENRF_CONN_PROFILE_LOW_LATENCY] = {
+    MSEC_TO_UNITS(7.5, UNIT_1_25_MS),
+    MSEC_TO_UNITS(7.5, UNIT_1_25_MS),
+    0,
+    MSEC_TO_UNITS(4000, UNIT_10_MS)
+  },
+  [ENRF_CONN_PROFILE_THROUGHPUT] = {
+    // Long intervals combined with connection event extension gives the least overhead
+    MSEC_TO_UNITS(30, UNIT_1_25_MS),
+    MSEC_TO_UNITS(50, UNIT_1_25_MS),
+    0,
+    MSEC_TO_UNITS(4000, UNIT_10_MS)
+  },
+  [ENRF_CONN_PROFILE_LOW_POWER] = {
+    MSEC_TO_UNITS(100, UNIT_1_25_MS),
+    MSEC_TO_UNITS(200, UNIT_1_25_MS),
+    4,
+    MSEC_TO_UNITS(6000, UNIT_10_MS)
+  }
+};
+
 static ble_gap_conn_params_t m_connection_param = {
   MSEC_TO_UNITS(20, UNIT_1_25_MS),
   MSEC_TO_UNITS(75, UNIT_1_25_MS),
@@ -99,33 +289,183 @@ static ble_gap_scan_params_t m_scan_params = {
   .scan_phys = BLE_GAP_PHY_AUTO
 };
 
+// Peers filtered by the link layer when scanning or connecting with the accept list
+static ble_gap_addr_t m_accept_addrs[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
+static uint8_t        m_accept_cnt = 0;
+static bool           m_accept_scan = false;
+
+// Requested window, limited when scanning on two PHYs
+static uint16_t m_scan_window = 0x0050;
+
 static uint8_t    m_scan_buffer[BLE_GAP_SCAN_BUFFER_EXTENDED_MIN];
 static ble_data_t m_adv_rep_buffer = {.p_data = m_scan_buffer, .len = sizeof(m_scan_buffer)};
 
-static uint16_t m_conn_handle = BLE_CONN_HANDLE_INVALID;
-static uint16_t m_ble_nus_max_data_len = BLE_GATT_ATT_MTU_DEFAULT - 3;
+// Scan report deduplication. A device is keyed by its address and whether it is a scan
+// response, and is reported when the payload hash changes or the report interval has passed
+typedef struct {
+  bool     used;
+  uint8_t  addr_type;
+  uint8_t  addr[BLE_GAP_ADDR_LEN];
+  bool     scan_rsp;
+  uint32_t data_hash;
+  uint32_t last_seen;    // app_timer ticks
+  uint32_t last_report;
+  int32_t  rssi_sum;     // Since the latest report
+  uint16_t rssi_cnt;
+  int8_t   rssi_min;
+  int8_t   rssi_max;
+} scan_dev_t;
+
+// Extended advertising data delivered by the softdevice in several reports, collected per
+// advertiser until the chain is complete
+typedef struct {
+  bool           used;
+  ble_gap_addr_t peer_addr;
+  uint8_t        set_id;
+  uint16_t       data_id;
+  uint32_t       seq;        // Allocation order, the oldest chain is dropped when out of buffers
+  uint16_t       len;
+  uint8_t        data[ENRF_ADV_CHAIN_SIZE];
+} adv_chain_t;
+
+static adv_chain_t            m_adv_chains[ENRF_ADV_CHAIN_BUFS];
+static uint32_t               m_adv_chain_seq = 0;
+static enrf_adv_chain_stats_t m_adv_chain_stats;
+static ble_gap_evt_adv_report_t m_adv_chain_report;
+
+static scan_dev_t        m_scan_devs[ENRF_SCAN_DEDUP_SIZE];
+static bool              m_scan_dedup = false;
+static uint32_t          m_scan_report_ticks = 0;
+static enrf_scan_stats_t m_scan_stats;
+
+// Transmit queue for streaming NUS data. Each message is stored with a two byte length
+// header and is sent in MTU sized packets as soon as the softdevice has room for them
+typedef ret_code_t (*tx_queue_send_t)(uint16_t conn_handle, uint8_t *data, uint16_t *length);
+
+// Application notification when a queue has been drained, common for all links in a role
+typedef struct {
+  nus_tx_cb_t cb;
+  uint32_t    low_watermark;
+} tx_notify_t;
+
+typedef struct {
+  uint8_t        *buffer;
+  uint32_t        size;
+  uint32_t        rd_pos;
+  uint32_t        wr_pos;
+  uint16_t        msg_left;
+  bool            above_watermark;
+  tx_notify_t    *notify;
+  tx_queue_send_t send;
+} tx_queue_t;
+
+// Pending GATT client request, completed in the order issued by the GATT queue
+typedef struct {
+  gatt_req_cb_t cb;
+  void         *p_context;
+  uint16_t      char_handle;
+} gatt_req_t;
+
+// Discovered database of a peer as stored in flash
+typedef struct {
+  ble_gap_addr_t    peer_addr;
+  bool              hash_valid;      // Peer has a database hash
+  uint8_t           hash[DATABASE_HASH_LEN];
+  uint16_t          sc_handle;       // Service Changed characteristic, 0 if not found
+  uint16_t          sc_cccd_handle;
+  uint8_t           srv_count;
+  ble_gatt_db_srv_t srv[ENRF_GATT_CACHE_MAX_SRV];
+} gatt_cache_t;
+
+typedef enum {
+  CACHE_IDLE,
+  CACHE_VALIDATING,  // Waiting for the database hash
+  CACHE_COLLECTING   // Discovery running, result to be stored
+} cache_state_t;
+
+// L2CAP channel with its SDU buffers. Transmit buffers are handed to the softdevice in order
+// and released on the tx events. Receive buffers belong to the application between the
+// rx event and enrf_l2cap_rx_release
+typedef struct {
+  uint16_t local_cid;      // BLE_L2CAP_CID_INVALID when unused
+  bool     connected;
+  uint16_t tx_mtu;         // SDU size accepted by the peer
+  uint8_t  tx_first;
+  uint8_t  tx_cnt;
+  uint8_t  tx_buf[ENRF_L2CAP_TX_BUFS][ENRF_L2CAP_MTU];
+  uint8_t  rx_buf[ENRF_L2CAP_RX_BUFS][ENRF_L2CAP_MTU];
+} l2cap_ch_t;
+
+// A link is either NUS server or client depending on its role, the queue buffer fits both
+#define LINK_TX_QUEUE_SIZE MAX(ENRF_NUS_TX_QUEUE_SIZE, ENRF_NUS_C_TX_QUEUE_SIZE)
+
+// State of each connection, indexed by the softdevice connection handle
+typedef struct {
+  uint16_t           conn_handle;   // BLE_CONN_HANDLE_INVALID when not connected
+  enrf_link_info_t   info;
+  uint16_t           nus_max_data_len;
+  tx_queue_t         nus_tx;
+  uint8_t            nus_tx_buffer[LINK_TX_QUEUE_SIZE];
+  ble_db_discovery_t db_discovery;
+  db_disc_cb_t       disc_cb;
+  nus_c_rx_cb_t      nus_c_rx_cb;
+  gatt_req_t         gatt_reqs[GATT_REQ_QUEUE_SIZE];
+  uint8_t            gatt_req_first;
+  uint8_t            gatt_req_cnt;
+  uint8_t            phy_pending;   // Requested while another procedure was ongoing, 0 when none
+#ifdef ENRF_GATT_CACHE
+  gatt_cache_t       cache;         // Loaded from flash or collected from discovery
+  bool               cache_found;
+  cache_state_t      cache_state;
+  bool               cache_hash_pending;  // Hash read waiting for another GATT procedure
+#endif
+#if ENRF_L2CAP_CHANNELS > 0
+  l2cap_ch_t         l2cap[ENRF_L2CAP_CHANNELS];
+#endif
+} link_t;
+
+static link_t m_links[NRF_SDH_BLE_TOTAL_LINK_COUNT];
+
+static ret_code_t nus_send(uint16_t conn_handle, uint8_t *data, uint16_t *length);
+static ret_code_t nus_c_send(uint16_t conn_handle, uint8_t *data, uint16_t *length);
+
+static tx_notify_t m_nus_tx_notify;
+static tx_notify_t m_nus_c_tx_notify;
 
 // Callbacks
 static nrf_sdh_ble_evt_handler_t m_app_evt_cb = NULL;
 static nus_rx_cb_t               m_app_nus_rec_cb = NULL;
 static scan_report_cb_t          m_adv_report_cb = NULL;
+// Used for the next central connection
 static nus_c_rx_cb_t             m_nus_c_rx_cb = NULL;
 static db_disc_cb_t              m_disc_cb = NULL;
-static ble_db_discovery_t        m_ble_db_discovery;
+static l2cap_rx_cb_t             m_l2cap_rx_cb = NULL;
+static l2cap_evt_cb_t            m_l2cap_evt_cb = NULL;
 
 // State variables
 static bool        m_is_advertising = false;
-static bool        m_is_central = false;
 static const char *m_device_name = "";
-static uint16_t    m_gatt_max_length;
 static int         m_restart = 0;
-static bool        m_long_range = false;
 static int         m_tx_power = 0;
 static bool        m_serial_active = false;
 
+// Handle of the latest central connection, for enrf_connect_wait
+static volatile uint16_t m_connect_handle = BLE_CONN_HANDLE_INVALID;
 static volatile bool m_disconnected = true;
 static volatile bool m_timeout = false;
 
+static ret_code_t tx_queue_process(link_t *p_link);
+static void tx_queue_flush(tx_queue_t *q);
+static void gatt_req_complete(link_t *p_link, uint16_t char_handle, uint16_t gatt_status,
+                              const uint8_t *data, uint16_t length);
+static void db_disc_handler(ble_db_discovery_evt_t *p_evt);
+static bool scan_dedup_check(ble_gap_evt_adv_report_t *p_adv_report);
+static ble_gap_evt_adv_report_t *adv_chain_reassemble(ble_gap_evt_adv_report_t *p_adv_report);
+static adv_phase_t adv_phase_first(bool reconnect);
+static ret_code_t adv_phase_start(adv_phase_t phase);
+static void adv_phase_timeout();
+static void link_phy_retry(link_t *p_link);
+
 __WEAK void assert_nrf_callback(uint16_t line_num, const uint8_t *p_file_name) {
   app_error_handler(0xDEADBEEF, line_num, p_file_name);
 }
@@ -211,10 +551,35 @@ static void nrf_qwr_error_handler(uint32_t nrf_error) {
 
 #define EQ_STR(s1, s2) (strcasestr(s1, s2) == s1)
 
+static link_t *link_get(uint16_t conn_handle) {
+  // Get the state of a connected link
+  if (conn_handle >= NRF_SDH_BLE_TOTAL_LINK_COUNT || m_links[conn_handle].conn_handle != conn_handle) {
+    return NULL;
+  }
+  return &m_links[conn_handle];
+}
+
+//--------------------------------------------------------------------------
+
+static link_t *link_get_role(uint16_t conn_handle, uint8_t role) {
+  link_t *p_link = link_get(conn_handle);
+  return p_link && p_link->info.role == role ? p_link : NULL;
+}
+
+//--------------------------------------------------------------------------
+
 static void nus_data_handler(ble_nus_evt_t *p_evt) {
-  if (p_evt->type == BLE_NUS_EVT_RX_DATA) {
+  uint16_t conn_handle = p_evt->conn_handle;
+  if (p_evt->type == BLE_NUS_EVT_COMM_STARTED) {
+    // Notifications enabled, send what might have been queued
+    link_t *p_link = link_get(conn_handle);
+    if (p_link) {
+      tx_queue_process(p_link);
+    }
+  } else if (p_evt->type == BLE_NUS_EVT_RX_DATA) {
     if (m_app_nus_rec_cb &&
-        m_app_nus_rec_cb((uint8_t *)p_evt->params.rx_data.p_data, p_evt->params.rx_data.length)) {
+        m_app_nus_rec_cb(conn_handle, (uint8_t *)p_evt->params.rx_data.p_data,
+                         p_evt->params.rx_data.length)) {
       return;
     }
     // Check for possible standard requests
@@ -227,17 +592,17 @@ static void nus_data_handler(ble_nus_evt_t *p_evt) {
     if (EQ_STR(str, "version?")) {
       char ver[80];
       snprintf(ver, sizeof(ver), "%s %s", _build_version, _build_time);
-      enrf_nus_string_send(ver);
+      enrf_nus_string_send(conn_handle, ver);
     } else if (EQ_STR(str, "mac?")) {
-      enrf_nus_string_send(enrf_get_device_address());
+      enrf_nus_string_send(conn_handle, enrf_get_device_address());
     } else if (EQ_STR(str, "restart")) {
       m_restart = 1;
-      enrf_nus_string_send("Restarting");
+      enrf_nus_string_send(conn_handle, "Restarting");
     } else if (EQ_STR(str, "dfu")) {
       m_restart = 2;
-      enrf_nus_string_send("Entering DFU");
+      enrf_nus_string_send(conn_handle, "Entering DFU");
     } else {
-      enrf_nus_string_send("* Unrecognized nus data");
+      enrf_nus_string_send(conn_handle, "* Unrecognized nus data");
     }
   }
 }
@@ -248,8 +613,10 @@ static void services_init(void) {
   uint32_t err_code;
   nrf_ble_qwr_init_t qwr_init = {0};
   qwr_init.error_handler = nrf_qwr_error_handler;
-  err_code = nrf_ble_qwr_init(&m_qwr, &qwr_init);
-  APP_ERROR_CHECK(err_code);
+  for (uint32_t i = 0; i < ARRAY_SIZE(m_qwr); i++) {
+    err_code = nrf_ble_qwr_init(&m_qwr[i], &qwr_init);
+    APP_ERROR_CHECK(err_code);
+  }
 
   ble_nus_init_t nus_init;
   memset(&nus_init, 0, sizeof(nus_init));
@@ -270,13 +637,49 @@ static void services_init(void) {
 static void on_conn_params_evt(ble_conn_params_evt_t *p_evt) {
   uint32_t err_code;
   if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED) {
-    err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
+    err_code = sd_ble_gap_disconnect(p_evt->conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
     APP_ERROR_CHECK(err_code);
   }
 }
 
 //--------------------------------------------------------------------------
 
+static bool conn_params_in_range(const ble_gap_conn_params_t *p_params) {
+  return p_params->max_conn_interval >= m_connection_param.min_conn_interval &&
+         p_params->max_conn_interval <= m_connection_param.max_conn_interval &&
+         p_params->slave_latency == m_connection_param.slave_latency;
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t conn_params_link_update(link_t *p_link) {
+  if (p_link->info.role == BLE_GAP_ROLE_CENTRAL) {
+    // Central decides directly
+    return sd_ble_gap_conn_param_update(p_link->conn_handle, &m_connection_param);
+  }
+  // Peripheral requests and the module retries if not accepted
+  return ble_conn_params_change_conn_params(p_link->conn_handle, &m_connection_param);
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t conn_params_update(void) {
+  // Update preferred parameters and apply them to all current connections
+  if (!nrf_sdh_is_enabled()) {
+    // Picked up by gap_params_init
+    return NRF_SUCCESS;
+  }
+  ret_code_t err_code = sd_ble_gap_ppcp_set(&m_connection_param);
+  for (uint16_t i = 0; i < NRF_SDH_BLE_TOTAL_LINK_COUNT && err_code == NRF_SUCCESS; i++) {
+    if (link_get(i)) {
+      err_code = conn_params_link_update(&m_links[i]);
+    }
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
 static void conn_params_error_handler(uint32_t nrf_error) {
   APP_ERROR_HANDLER(nrf_error);
 }
@@ -288,8 +691,8 @@ static void conn_params_init(void) {
   ble_conn_params_init_t cp_init;
   memset(&cp_init, 0, sizeof(cp_init));
   cp_init.p_conn_params = NULL;
-  cp_init.first_conn_params_update_delay = APP_TIMER_TICKS(5000);
-  cp_init.next_conn_params_update_delay = APP_TIMER_TICKS(30000);
+  cp_init.first_conn_params_update_delay = APP_TIMER_TICKS(ENRF_CONN_PARAMS_FIRST_DELAY_MS);
+  cp_init.next_conn_params_update_delay = APP_TIMER_TICKS(ENRF_CONN_PARAMS_NEXT_DELAY_MS);
   cp_init.max_conn_params_update_count = 3;
   cp_init.start_on_notify_cccd_handle = BLE_GATT_HANDLE_INVALID;
   cp_init.disconnect_on_fail = false;
@@ -301,293 +704,1817 @@ static void conn_params_init(void) {
 
 //--------------------------------------------------------------------------
 
-static void ble_evt_handler(ble_evt_t const *p_ble_evt, void *p_context) {
-  uint32_t err_code;
+#ifdef ENRF_GATT_CACHE
 
-  switch (p_ble_evt->header.evt_id) {
-    case BLE_GAP_EVT_CONNECTED:
-      NRF_LOG_DEBUG("Connected");
-      m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-      err_code = nrf_ble_qwr_conn_handle_assign(&m_qwr, m_conn_handle);
-      APP_ERROR_CHECK(err_code);
-      if (m_is_central) {
-        memset(&m_ble_db_discovery, 0, sizeof(m_ble_db_discovery));
-        ble_db_discovery_start(&m_ble_db_discovery, p_ble_evt->evt.gap_evt.conn_handle);
-      }
-      break;
+static bool m_fds_ready = false;
+static volatile bool m_cache_write_busy = false;
+// Records are written asynchronously, keep the data until done
+static gatt_cache_t m_cache_write;
 
-    case BLE_GAP_EVT_DISCONNECTED:
-      NRF_LOG_DEBUG("Disconnected: reason 0x%x.", p_ble_evt->evt.gap_evt.params.disconnected.reason);
-      m_conn_handle = BLE_CONN_HANDLE_INVALID;
-      if (m_is_advertising) {
-        sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
-      }
-      m_is_central = false;
-      m_disconnected = true;
+static void fds_evt_handler(fds_evt_t const *p_evt) {
+  switch (p_evt->id) {
+    case FDS_EVT_INIT:
+      m_fds_ready = p_evt->result == NRF_SUCCESS;
       break;
 
-    case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
-      NRF_LOG_DEBUG("PHY update request.");
-      ble_gap_phys_t const phys = {
-        .rx_phys = BLE_GAP_PHY_AUTO,
-        .tx_phys = BLE_GAP_PHY_AUTO,
-      };
-      err_code = sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys);
-      APP_ERROR_CHECK(err_code);
-    }
-    break;
-
-    case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
-      // Pairing not supported
-      err_code = sd_ble_gap_sec_params_reply(m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL,
-                                             NULL);
-      APP_ERROR_CHECK(err_code);
+    case FDS_EVT_WRITE:
+    case FDS_EVT_UPDATE:
+      m_cache_write_busy = false;
       break;
 
-    case BLE_GAP_EVT_ADV_REPORT: {
-      ble_evt_t *p = (ble_evt_t *)p_ble_evt;
-      ble_gap_evt_t *p_gap_evt = &p->evt.gap_evt;
-      if (!m_adv_report_cb || !m_adv_report_cb(&p_gap_evt->params.adv_report))
-        if (sd_ble_gap_scan_start(NULL, &m_adv_rep_buffer) != NRF_SUCCESS) {
-          NRF_LOG_ERROR("Failed to restart scanning");
-        }
+    default:
       break;
-    }
+  }
+}
 
-    case BLE_GAP_EVT_TIMEOUT: {
-      const ble_gap_evt_t *p_gap_evt = &p_ble_evt->evt.gap_evt;
-      if (p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_SCAN) {
-        NRF_LOG_ERROR("Scan timed out");
-      } else if (p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_CONN) {
-        NRF_LOG_ERROR("Connection Request timed out");
+//--------------------------------------------------------------------------
+
+static bool gatt_cache_find(const ble_gap_addr_t *p_addr, fds_record_desc_t *p_desc,
+                            gatt_cache_t *p_cache) {
+  // Look up the record of a peer and optionally load it
+  fds_find_token_t token;
+  fds_flash_record_t record;
+  bool found = false;
+  memset(&token, 0, sizeof(token));
+  while (!found && fds_record_find(GATT_CACHE_FILE_ID, GATT_CACHE_REC_KEY, p_desc, &token) == NRF_SUCCESS) {
+    if (fds_record_open(p_desc, &record) == NRF_SUCCESS) {
+      const gatt_cache_t *p_stored = record.p_data;
+      found = p_stored->peer_addr.addr_type == p_addr->addr_type &&
+              memcmp(p_stored->peer_addr.addr, p_addr->addr, BLE_GAP_ADDR_LEN) == 0;
+      if (found && p_cache) {
+        memcpy(p_cache, p_stored, MIN(sizeof(*p_cache), record.p_header->length_words * sizeof(uint32_t)));
+        p_cache->srv_count = MIN(p_cache->srv_count, ENRF_GATT_CACHE_MAX_SRV);
       }
-      m_timeout = true;
-      break;
+      fds_record_close(p_desc);
     }
+  }
+  return found;
+}
 
-    case BLE_GATTS_EVT_SYS_ATTR_MISSING:
-      // No system attributes have been stored.
-      err_code = sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0, 0);
-      APP_ERROR_CHECK(err_code);
-      break;
+//--------------------------------------------------------------------------
 
-    case BLE_GATTC_EVT_TIMEOUT:
-      // Disconnect on GATT Client timeout event.
-      err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gattc_evt.conn_handle,
-                                       BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-      APP_ERROR_CHECK(err_code);
-      break;
+static void gatt_cache_store(const gatt_cache_t *p_cache) {
+  // Only one write at a time, the next connection will store it otherwise
+  if (!m_fds_ready || m_cache_write_busy) {
+    return;
+  }
+  fds_record_desc_t desc;
+  fds_record_t record;
+  ret_code_t err_code;
+  m_cache_write = *p_cache;
+  record.file_id = GATT_CACHE_FILE_ID;
+  record.key = GATT_CACHE_REC_KEY;
+  record.data.p_data = &m_cache_write;
+  record.data.length_words = (offsetof(gatt_cache_t, srv) + p_cache->srv_count * sizeof(ble_gatt_db_srv_t) +
+                              sizeof(uint32_t) - 1) / sizeof(uint32_t);
+  if (gatt_cache_find(&p_cache->peer_addr, &desc, NULL)) {
+    err_code = fds_record_update(&desc, &record);
+  } else {
+    err_code = fds_record_write(&desc, &record);
+  }
+  if (err_code == FDS_ERR_NO_SPACE_IN_FLASH) {
+    // Reclaim space from updated and deleted records for the next time
+    fds_gc();
+  }
+  m_cache_write_busy = err_code == NRF_SUCCESS;
+  NRF_LOG_DEBUG("GATT cache store: 0x%X", err_code);
+}
 
-    case BLE_GATTS_EVT_TIMEOUT:
-      // Disconnect on GATT Server timeout event.
-      err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gatts_evt.conn_handle,
-                                       BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-      APP_ERROR_CHECK(err_code);
-      break;
+//--------------------------------------------------------------------------
 
-    case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
-      m_gatt_max_length = p_ble_evt->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets;
-      break;
+static void gatt_cache_discover(link_t *p_link) {
+  // Full discovery, collecting the result for the cache
+  p_link->cache.srv_count = 0;
+  p_link->cache.sc_handle = 0;
+  p_link->cache.sc_cccd_handle = 0;
+  p_link->cache_state = CACHE_COLLECTING;
+  memset(&p_link->db_discovery, 0, sizeof(p_link->db_discovery));
+  ble_db_discovery_start(&p_link->db_discovery, p_link->conn_handle);
+}
 
-    default:
-      break;
-  }
+//--------------------------------------------------------------------------
 
-  if (m_is_central) {
-    ble_db_discovery_on_ble_evt(p_ble_evt, &m_ble_db_discovery);
+static void gatt_cache_apply(link_t *p_link) {
+  // Feed the cached services as if they were just discovered
+  ble_db_discovery_evt_t evt;
+  NRF_LOG_DEBUG("Using GATT cache for: %s", enrf_addr_to_str(&p_link->info.peer_addr));
+  p_link->cache_state = CACHE_IDLE;
+  memset(&evt, 0, sizeof(evt));
+  evt.conn_handle = p_link->conn_handle;
+  evt.evt_type = BLE_DB_DISCOVERY_COMPLETE;
+  for (uint8_t i = 0; i < p_link->cache.srv_count; i++) {
+    evt.params.discovered_db = p_link->cache.srv[i];
+    db_disc_handler(&evt);
   }
+  evt.evt_type = BLE_DB_DISCOVERY_AVAILABLE;
+  db_disc_handler(&evt);
+  if (p_link->cache.sc_cccd_handle) {
+    // Indications are needed to detect changes for peers without database hash
+    enrf_gatt_notif_enable(p_link->conn_handle, p_link->cache.sc_cccd_handle, true, NULL, NULL);
+  }
+}
 
-  if (m_app_evt_cb) {
-    m_app_evt_cb(p_ble_evt, p_context);
+//--------------------------------------------------------------------------
+
+static void gatt_cache_validate(link_t *p_link, const uint8_t *hash) {
+  // A cached database is valid when the hashes are equal or when neither have one
+  // The hash is NULL only when the peer has confirmed that it has none
+  bool valid = p_link->cache_found &&
+               (hash ? p_link->cache.hash_valid && memcmp(hash, p_link->cache.hash, DATABASE_HASH_LEN) == 0 :
+                !p_link->cache.hash_valid);
+  p_link->cache.hash_valid = hash != NULL;
+  if (hash) {
+    memcpy(p_link->cache.hash, hash, DATABASE_HASH_LEN);
+  }
+  if (valid) {
+    gatt_cache_apply(p_link);
+  } else {
+    gatt_cache_discover(p_link);
   }
 }
 
 //--------------------------------------------------------------------------
 
-static void ble_stack_init(void) {
-  ret_code_t err_code;
+static void gatt_cache_read_failed(link_t *p_link) {
+  // Unknown if the peer has a hash, the cache can not be trusted
+  NRF_LOG_DEBUG("GATT cache hash read failed");
+  p_link->cache.hash_valid = false;
+  gatt_cache_discover(p_link);
+}
 
-  err_code = nrf_sdh_enable_request();
-  APP_ERROR_CHECK(err_code);
+//--------------------------------------------------------------------------
 
-  // Configure the BLE stack using the default settings.
-  // Fetch the start address of the application RAM.
-  uint32_t ram_start = 0;
-  err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
-  APP_ERROR_CHECK(err_code);
+static void gatt_cache_hash_read(link_t *p_link) {
+  // The softdevice runs one client procedure at a time, such as the MTU exchange started
+  // on connect. Retried when that one is done
+  const ble_uuid_t hash_uuid = {.uuid = UUID_DATABASE_HASH, .type = BLE_UUID_TYPE_BLE};
+  const ble_gattc_handle_range_t range = {.start_handle = 0x0001, .end_handle = 0xFFFF};
+  ret_code_t err_code = sd_ble_gattc_char_value_by_uuid_read(p_link->conn_handle, &hash_uuid, &range);
+  p_link->cache_hash_pending = err_code == NRF_ERROR_BUSY;
+  if (err_code != NRF_SUCCESS && err_code != NRF_ERROR_BUSY) {
+    gatt_cache_read_failed(p_link);
+  }
+}
 
-  // Enable BLE stack.
-  err_code = nrf_sdh_ble_enable(&ram_start);
-  APP_ERROR_CHECK(err_code);
+//--------------------------------------------------------------------------
 
-  // Register a handler for BLE events.
-  NRF_SDH_BLE_OBSERVER(m_ble_observer, APP_BLE_OBSERVER_PRIO, ble_evt_handler, NULL);
+static void gatt_cache_connect(link_t *p_link) {
+  // Load a possible cached database and read the database hash of the peer to validate it
+  fds_record_desc_t desc;
+  memset(&p_link->cache, 0, offsetof(gatt_cache_t, srv));
+  p_link->cache_found = m_fds_ready && gatt_cache_find(&p_link->info.peer_addr, &desc, &p_link->cache);
+  p_link->cache.peer_addr = p_link->info.peer_addr;
+  p_link->cache_state = CACHE_VALIDATING;
+  gatt_cache_hash_read(p_link);
 }
 
 //--------------------------------------------------------------------------
 
-static void gatt_evt_handler(nrf_ble_gatt_t *p_gatt, nrf_ble_gatt_evt_t const *p_evt) {
-  if ((m_conn_handle == p_evt->conn_handle) && (p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED)) {
-    m_ble_nus_max_data_len = p_evt->params.att_mtu_effective - OPCODE_LENGTH - HANDLE_LENGTH;
-    NRF_LOG_DEBUG("Data len is set to 0x%X(%d)", m_ble_nus_max_data_len, m_ble_nus_max_data_len);
+static void gatt_cache_collect(link_t *p_link, const ble_db_discovery_evt_t *p_evt) {
+  gatt_cache_t *p_cache = &p_link->cache;
+  if (p_link->cache_state != CACHE_COLLECTING) {
+    return;
+  }
+  if (p_evt->evt_type == BLE_DB_DISCOVERY_COMPLETE) {
+    const ble_gatt_db_srv_t *p_srv = &p_evt->params.discovered_db;
+    if (p_cache->srv_count < ENRF_GATT_CACHE_MAX_SRV) {
+      p_cache->srv[p_cache->srv_count++] = *p_srv;
+    }
+    if (p_srv->srv_uuid.uuid == BLE_UUID_GATT && p_srv->srv_uuid.type == BLE_UUID_TYPE_BLE) {
+      for (uint8_t i = 0; i < p_srv->char_count; i++) {
+        if (p_srv->charateristics[i].characteristic.uuid.uuid == BLE_UUID_GATT_CHARACTERISTIC_SERVICE_CHANGED) {
+          p_cache->sc_handle = p_srv->charateristics[i].characteristic.handle_value;
+          p_cache->sc_cccd_handle = p_srv->charateristics[i].cccd_handle;
+        }
+      }
+    }
+  } else if (p_evt->evt_type == BLE_DB_DISCOVERY_AVAILABLE) {
+    p_link->cache_state = CACHE_IDLE;
+    gatt_cache_store(p_cache);
   }
-  NRF_LOG_DEBUG("ATT MTU exchange completed. central 0x%x peripheral 0x%x",
-                p_gatt->att_mtu_desired_central,
-                p_gatt->att_mtu_desired_periph);
 }
 
 //--------------------------------------------------------------------------
 
-static void gatt_init(void) {
-  ret_code_t err_code;
-  err_code = nrf_ble_gatt_init(&m_gatt, gatt_evt_handler);
-  APP_ERROR_CHECK(err_code);
-  err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
-  APP_ERROR_CHECK(err_code);
+static void gatt_cache_on_ble_evt(link_t *p_link, ble_evt_t const *p_ble_evt) {
+  const ble_gattc_evt_t *p_gattc_evt = &p_ble_evt->evt.gattc_evt;
+  if (p_link->cache_hash_pending && p_link->cache_state == CACHE_VALIDATING &&
+      p_ble_evt->header.evt_id >= BLE_GATTC_EVT_BASE && p_ble_evt->header.evt_id <= BLE_GATTC_EVT_LAST) {
+    // The procedure blocking the hash read has completed, e.g. the MTU exchange
+    gatt_cache_hash_read(p_link);
+  }
+  switch (p_ble_evt->header.evt_id) {
+    case BLE_GATTC_EVT_CHAR_VAL_BY_UUID_READ_RSP: {
+      const ble_gattc_evt_char_val_by_uuid_read_rsp_t *p_rsp = &p_gattc_evt->params.char_val_by_uuid_read_rsp;
+      if (p_link->cache_state != CACHE_VALIDATING) {
+        break;
+      }
+      if (p_gattc_evt->gatt_status == BLE_GATT_STATUS_ATTERR_ATTRIBUTE_NOT_FOUND) {
+        // Peer has no database hash
+        gatt_cache_validate(p_link, NULL);
+      } else if (p_gattc_evt->gatt_status == BLE_GATT_STATUS_SUCCESS && p_rsp->count &&
+                 p_rsp->value_len == DATABASE_HASH_LEN) {
+        // Each entry is a handle followed by the value
+        gatt_cache_validate(p_link, p_rsp->handle_value + sizeof(uint16_t));
+      } else {
+        gatt_cache_read_failed(p_link);
+      }
+      break;
+    }
+
+    case BLE_GATTC_EVT_HVX:
+      if (p_link->cache.sc_handle && p_gattc_evt->params.hvx.handle == p_link->cache.sc_handle) {
+        // Peer database has changed, drop the cache and discover again
+        NRF_LOG_INFO("Service changed indicated");
+        if (p_gattc_evt->params.hvx.type == BLE_GATT_HVX_INDICATION) {
+          sd_ble_gattc_hv_confirm(p_link->conn_handle, p_gattc_evt->params.hvx.handle);
+        }
+        if (p_link->cache_state == CACHE_IDLE) {
+          p_link->info.disc_state = ENRF_DISC_RUNNING;
+          gatt_cache_discover(p_link);
+        }
+      }
+      break;
+
+    default:
+      break;
+  }
 }
 
 //--------------------------------------------------------------------------
 
-static void log_init(void) {
-  ret_code_t err_code = NRF_LOG_INIT(NULL);
+static void gatt_cache_init(void) {
+  // Discover the GATT service as well to learn the Service Changed characteristic
+  const ble_uuid_t gatt_uuid = {.uuid = BLE_UUID_GATT, .type = BLE_UUID_TYPE_BLE};
+  ret_code_t err_code = ble_db_discovery_evt_register(&gatt_uuid);
+  APP_ERROR_CHECK(err_code);
+  err_code = fds_register(fds_evt_handler);
+  APP_ERROR_CHECK(err_code);
+  err_code = fds_init();
   APP_ERROR_CHECK(err_code);
-  NRF_LOG_DEFAULT_BACKENDS_INIT();
 }
 
 //--------------------------------------------------------------------------
 
-static void power_management_init(void) {
-  ret_code_t err_code;
-  err_code = nrf_pwr_mgmt_init();
-  APP_ERROR_CHECK(err_code);
+ret_code_t enrf_gatt_cache_clear() {
+  return fds_file_delete(GATT_CACHE_FILE_ID);
+}
+
+#else
+
+ret_code_t enrf_gatt_cache_clear() {
+  return NRF_ERROR_NOT_SUPPORTED;
 }
 
+#endif
+
 //--------------------------------------------------------------------------
 
-static void db_disc_handler(ble_db_discovery_evt_t *p_evt) {
-  if (m_nus_c_rx_cb) {
-    ble_nus_c_on_db_disc_evt(&m_ble_nus_c, p_evt);
+#if ENRF_L2CAP_CHANNELS > 0
+
+// Incoming channels are accepted on this PSM, 0 refuses all
+static uint16_t m_l2cap_psm = 0;
+
+static l2cap_ch_t *l2cap_ch_get(link_t *p_link, uint16_t local_cid) {
+  if (!p_link || local_cid == BLE_L2CAP_CID_INVALID) {
+    return NULL;
   }
-  if (m_disc_cb) {
-    m_disc_cb(p_evt);
+  for (uint8_t i = 0; i < ENRF_L2CAP_CHANNELS; i++) {
+    if (p_link->l2cap[i].local_cid == local_cid) {
+      return &p_link->l2cap[i];
+    }
   }
+  return NULL;
 }
+
 //--------------------------------------------------------------------------
 
-void enrf_set_phy(bool long_range) {
-  m_long_range = long_range;
+static l2cap_ch_t *l2cap_ch_get_free(link_t *p_link) {
+  for (uint8_t i = 0; i < ENRF_L2CAP_CHANNELS; i++) {
+    if (p_link->l2cap[i].local_cid == BLE_L2CAP_CID_INVALID) {
+      return &p_link->l2cap[i];
+    }
+  }
+  return NULL;
 }
 
 //--------------------------------------------------------------------------
 
-void enrf_set_tx_power(int tx_power) {
-  m_tx_power = MAX(-40, MIN(8, tx_power));
+static void l2cap_evt(uint16_t conn_handle, uint16_t local_cid, enrf_l2cap_evt_t evt, uint16_t param) {
+  if (m_l2cap_evt_cb) {
+    m_l2cap_evt_cb(conn_handle, local_cid, evt, param);
+  }
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_start_advertise(bool connectable,
-                                uint16_t company_id, ble_advdata_name_type_t type,
-                                uint8_t *p_data, uint8_t size,
-                                uint32_t interval_ms, uint32_t timeout_s,
-                                nus_rx_cb_t nus_cb) {
-  uint32_t err_code;
-  ble_advdata_t advdata;
+static ret_code_t l2cap_ch_setup(link_t *p_link, l2cap_ch_t *p_ch, uint16_t *p_local_cid, uint16_t psm,
+                                 uint16_t status) {
+  // Request or respond to a channel setup, the first receive buffer is given here
+  ble_l2cap_ch_setup_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.le_psm = psm;
+  params.status = status;
+  params.rx_params.rx_mtu = ENRF_L2CAP_MTU;
+  params.rx_params.rx_mps = ENRF_L2CAP_MPS;
+  if (p_ch) {
+    params.rx_params.sdu_buf.p_data = p_ch->rx_buf[0];
+    params.rx_params.sdu_buf.len = ENRF_L2CAP_MTU;
+  }
+  return sd_ble_l2cap_ch_setup(p_link->conn_handle, p_local_cid, &params);
+}
 
-  enrf_stop_advertise(m_adv_handle);
+//--------------------------------------------------------------------------
 
-  m_app_nus_rec_cb = nus_cb;
+static void l2cap_ch_close(link_t *p_link, l2cap_ch_t *p_ch) {
+  uint16_t local_cid = p_ch->local_cid;
+  bool connected = p_ch->connected;
+  p_ch->local_cid = BLE_L2CAP_CID_INVALID;
+  p_ch->connected = false;
+  p_ch->tx_cnt = 0;
+  if (connected) {
+    l2cap_evt(p_link->conn_handle, local_cid, ENRF_L2CAP_EVT_RELEASED, 0);
+  }
+}
 
-  // Set advertisement data
-  memset(&advdata, 0, sizeof(advdata));
-  advdata.name_type = type;
-  advdata.flags = connectable ? BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE :
-                  BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
-  if (p_data != NULL) {
-    static ble_advdata_manuf_data_t manuf_specific_data;
-    manuf_specific_data.company_identifier = company_id;
+//--------------------------------------------------------------------------
+
+static void l2cap_link_close(link_t *p_link) {
+  for (uint8_t i = 0; i < ENRF_L2CAP_CHANNELS; i++) {
+    if (p_link->l2cap[i].local_cid != BLE_L2CAP_CID_INVALID) {
+      l2cap_ch_close(p_link, &p_link->l2cap[i]);
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void l2cap_on_ble_evt(link_t *p_link, ble_evt_t const *p_ble_evt) {
+  const ble_l2cap_evt_t *p_l2cap_evt = &p_ble_evt->evt.l2cap_evt;
+  uint16_t conn_handle = p_l2cap_evt->conn_handle;
+  uint16_t local_cid = p_l2cap_evt->local_cid;
+  l2cap_ch_t *p_ch = l2cap_ch_get(p_link, local_cid);
+
+  switch (p_ble_evt->header.evt_id) {
+    case BLE_L2CAP_EVT_CH_SETUP_REQUEST: {
+      uint16_t psm = p_l2cap_evt->params.ch_setup_request.le_psm;
+      // Accept on the registered PSM while there is a free channel
+      p_ch = m_l2cap_psm && psm == m_l2cap_psm ? l2cap_ch_get_free(p_link) : NULL;
+      if (p_ch) {
+        p_ch->local_cid = local_cid;
+        p_ch->tx_mtu = p_l2cap_evt->params.ch_setup_request.tx_params.tx_mtu;
+      }
+      ret_code_t err_code = l2cap_ch_setup(p_link, p_ch, &local_cid, psm,
+                                           p_ch ? BLE_L2CAP_CH_STATUS_CODE_SUCCESS :
+                                           BLE_L2CAP_CH_STATUS_CODE_LE_PSM_NOT_SUPPORTED);
+      if (err_code != NRF_SUCCESS && p_ch) {
+        NRF_LOG_ERROR("L2CAP setup reply failed: 0x%X", err_code);
+        p_ch->local_cid = BLE_L2CAP_CID_INVALID;
+      }
+      break;
+    }
+
+    case BLE_L2CAP_EVT_CH_SETUP_REFUSED:
+      if (p_ch) {
+        p_ch->local_cid = BLE_L2CAP_CID_INVALID;
+        l2cap_evt(conn_handle, local_cid, ENRF_L2CAP_EVT_REFUSED,
+                  p_l2cap_evt->params.ch_setup_refused.status);
+      }
+      break;
+
+    case BLE_L2CAP_EVT_CH_SETUP:
+      if (p_ch) {
+        p_ch->connected = true;
+        p_ch->tx_mtu = MIN(p_l2cap_evt->params.ch_setup.tx_params.tx_mtu, ENRF_L2CAP_MTU);
+        p_ch->tx_first = 0;
+        p_ch->tx_cnt = 0;
+        // Give the peer credits for a complete SDU and queue the rest of the receive buffers
+        sd_ble_l2cap_ch_flow_control(conn_handle, local_cid, ENRF_L2CAP_CREDITS, NULL);
+        for (uint8_t i = 1; i < ENRF_L2CAP_RX_BUFS; i++) {
+          enrf_l2cap_rx_release(conn_handle, local_cid, p_ch->rx_buf[i]);
+        }
+        l2cap_evt(conn_handle, local_cid, ENRF_L2CAP_EVT_CONNECTED, p_ch->tx_mtu);
+      }
+      break;
+
+    case BLE_L2CAP_EVT_CH_RELEASED:
+      if (p_ch) {
+        l2cap_ch_close(p_link, p_ch);
+      }
+      break;
+
+    case BLE_L2CAP_EVT_CH_RX:
+      // The SDU is reassembled by the softdevice, pass on the buffer without copying
+      if (p_ch && m_l2cap_rx_cb) {
+        m_l2cap_rx_cb(conn_handle, local_cid, p_l2cap_evt->params.rx.sdu_buf.p_data,
+                      p_l2cap_evt->params.rx.sdu_len);
+      } else if (p_ch) {
+        enrf_l2cap_rx_release(conn_handle, local_cid, p_l2cap_evt->params.rx.sdu_buf.p_data);
+      }
+      break;
+
+    case BLE_L2CAP_EVT_CH_TX:
+      if (p_ch && p_ch->tx_cnt) {
+        p_ch->tx_first = (p_ch->tx_first + 1) % ENRF_L2CAP_TX_BUFS;
+        p_ch->tx_cnt--;
+        l2cap_evt(conn_handle, local_cid, ENRF_L2CAP_EVT_TX_DONE, p_ch->tx_cnt);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_l2cap_register(uint16_t psm, l2cap_rx_cb_t rx_cb, l2cap_evt_cb_t evt_cb) {
+  m_l2cap_psm = psm;
+  m_l2cap_rx_cb = rx_cb;
+  m_l2cap_evt_cb = evt_cb;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_open(uint16_t conn_handle, uint16_t psm, uint16_t *p_local_cid) {
+  link_t *p_link = link_get(conn_handle);
+  l2cap_ch_t *p_ch = p_link ? l2cap_ch_get_free(p_link) : NULL;
+  if (!p_link) {
+    return NRF_ERROR_INVALID_STATE;
+  } else if (!p_ch) {
+    return NRF_ERROR_NO_MEM;
+  }
+  uint16_t local_cid = BLE_L2CAP_CID_INVALID;
+  ret_code_t err_code = l2cap_ch_setup(p_link, p_ch, &local_cid, psm, 0);
+  if (err_code == NRF_SUCCESS) {
+    p_ch->local_cid = local_cid;
+    if (p_local_cid) {
+      *p_local_cid = local_cid;
+    }
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_close(uint16_t conn_handle, uint16_t local_cid) {
+  if (!l2cap_ch_get(link_get(conn_handle), local_cid)) {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+  return sd_ble_l2cap_ch_release(conn_handle, local_cid);
+}
+
+//--------------------------------------------------------------------------
+
+uint8_t enrf_l2cap_tx_free(uint16_t conn_handle, uint16_t local_cid) {
+  l2cap_ch_t *p_ch = l2cap_ch_get(link_get(conn_handle), local_cid);
+  return p_ch && p_ch->connected ? ENRF_L2CAP_TX_BUFS - p_ch->tx_cnt : 0;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_send(uint16_t conn_handle, uint16_t local_cid, const uint8_t *data,
+                           uint16_t length) {
+  l2cap_ch_t *p_ch = l2cap_ch_get(link_get(conn_handle), local_cid);
+  if (!p_ch || !p_ch->connected) {
+    return NRF_ERROR_INVALID_STATE;
+  } else if (!length || length > p_ch->tx_mtu) {
+    return NRF_ERROR_DATA_SIZE;
+  } else if (p_ch->tx_cnt == ENRF_L2CAP_TX_BUFS) {
+    return NRF_ERROR_RESOURCES;
+  }
+  // The softdevice uses the buffer until the tx event
+  ret_code_t err_code;
+  CRITICAL_REGION_ENTER();
+  uint8_t *p_buf = p_ch->tx_buf[(p_ch->tx_first + p_ch->tx_cnt) % ENRF_L2CAP_TX_BUFS];
+  memcpy(p_buf, data, length);
+  ble_data_t sdu = {.p_data = p_buf, .len = length};
+  err_code = sd_ble_l2cap_ch_tx(conn_handle, local_cid, &sdu);
+  if (err_code == NRF_SUCCESS) {
+    p_ch->tx_cnt++;
+  }
+  CRITICAL_REGION_EXIT();
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_rx_release(uint16_t conn_handle, uint16_t local_cid, uint8_t *data) {
+  l2cap_ch_t *p_ch = l2cap_ch_get(link_get(conn_handle), local_cid);
+  if (!p_ch || !p_ch->connected) {
+    // Buffers are reclaimed when the channel is set up again
+    return NRF_ERROR_INVALID_STATE;
+  }
+  ble_data_t sdu = {.p_data = data, .len = ENRF_L2CAP_MTU};
+  return sd_ble_l2cap_ch_rx(conn_handle, local_cid, &sdu);
+}
+
+#else
+
+void enrf_l2cap_register(uint16_t psm, l2cap_rx_cb_t rx_cb, l2cap_evt_cb_t evt_cb) {
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_open(uint16_t conn_handle, uint16_t psm, uint16_t *p_local_cid) {
+  return NRF_ERROR_NOT_SUPPORTED;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_close(uint16_t conn_handle, uint16_t local_cid) {
+  return NRF_ERROR_NOT_SUPPORTED;
+}
+
+//--------------------------------------------------------------------------
+
+uint8_t enrf_l2cap_tx_free(uint16_t conn_handle, uint16_t local_cid) {
+  return 0;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_send(uint16_t conn_handle, uint16_t local_cid, const uint8_t *data,
+                           uint16_t length) {
+  return NRF_ERROR_NOT_SUPPORTED;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_l2cap_rx_release(uint16_t conn_handle, uint16_t local_cid, uint8_t *data) {
+  return NRF_ERROR_NOT_SUPPORTED;
+}
+
+#endif
+
+//--------------------------------------------------------------------------
+
+static uint8_t link_phy_preference(bool central) {
+  return central ? m_phy_policy.central_link_phys : m_phy_policy.periph_link_phys;
+}
+
+//--------------------------------------------------------------------------
+
+static uint8_t link_count(uint8_t role) {
+  uint8_t cnt = 0;
+  for (uint16_t i = 0; i < NRF_SDH_BLE_TOTAL_LINK_COUNT; i++) {
+    cnt += link_get_role(i, role) != NULL;
+  }
+  return cnt;
+}
+
+//--------------------------------------------------------------------------
+
+static link_t *link_open(uint16_t conn_handle, const ble_gap_evt_connected_t *p_connected) {
+  link_t *p_link = &m_links[conn_handle];
+  bool central = p_connected->role == BLE_GAP_ROLE_CENTRAL;
+  memset(&p_link->info, 0, sizeof(p_link->info));
+  // Link starts with default values until MTU and data length have been negotiated
+  p_link->nus_max_data_len = BLE_GATT_ATT_MTU_DEFAULT - OPCODE_LENGTH - HANDLE_LENGTH;
+  p_link->info.att_mtu = BLE_GATT_ATT_MTU_DEFAULT;
+  p_link->info.max_tx_octets = BLE_GAP_DATA_LENGTH_DEFAULT;
+  p_link->info.max_rx_octets = BLE_GAP_DATA_LENGTH_DEFAULT;
+  p_link->info.tx_phy = BLE_GAP_PHY_1MBPS;
+  p_link->info.rx_phy = BLE_GAP_PHY_1MBPS;
+  p_link->info.role = p_connected->role;
+  p_link->info.conn_params = p_connected->conn_params;
+  p_link->info.peer_addr = p_connected->peer_addr;
+  p_link->info.disc_state = ENRF_DISC_IDLE;
+  p_link->phy_pending = 0;
+  // Data is sent as NUS server when peripheral and as client when central
+  p_link->nus_tx.buffer = p_link->nus_tx_buffer;
+  p_link->nus_tx.size = central ? ENRF_NUS_C_TX_QUEUE_SIZE : ENRF_NUS_TX_QUEUE_SIZE;
+  p_link->nus_tx.rd_pos = p_link->nus_tx.wr_pos = 0;
+  p_link->nus_tx.msg_left = 0;
+  p_link->nus_tx.above_watermark = false;
+  p_link->nus_tx.notify = central ? &m_nus_c_tx_notify : &m_nus_tx_notify;
+  p_link->nus_tx.send = central ? nus_c_send : nus_send;
+  p_link->disc_cb = central ? m_disc_cb : NULL;
+  p_link->nus_c_rx_cb = central ? m_nus_c_rx_cb : NULL;
+  p_link->gatt_req_first = 0;
+  p_link->gatt_req_cnt = 0;
+  memset(&p_link->db_discovery, 0, sizeof(p_link->db_discovery));
+#if ENRF_L2CAP_CHANNELS > 0
+  for (uint8_t i = 0; i < ENRF_L2CAP_CHANNELS; i++) {
+    p_link->l2cap[i].local_cid = BLE_L2CAP_CID_INVALID;
+    p_link->l2cap[i].connected = false;
+  }
+#endif
+  p_link->conn_handle = conn_handle;
+  return p_link;
+}
+
+//--------------------------------------------------------------------------
+
+static void ble_evt_handler(ble_evt_t const *p_ble_evt, void *p_context) {
+  uint32_t err_code;
+  uint8_t link_phys;
+  bool periph_lost = false;
+  // The handle is at the same position for all connection related events
+  uint16_t conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+  link_t *p_link = link_get(conn_handle);
+  bool reconnect = false;
+
+  switch (p_ble_evt->header.evt_id) {
+    case BLE_GAP_EVT_CONNECTED:
+      NRF_LOG_DEBUG("Connected, handle: %d", conn_handle);
+      p_link = link_open(conn_handle, &p_ble_evt->evt.gap_evt.params.connected);
+      err_code = nrf_ble_qwr_conn_handle_assign(&m_qwr[conn_handle], conn_handle);
+      APP_ERROR_CHECK(err_code);
+#if SDK_VERSION >= 17
+      // GATT client requests are possible in both roles
+      err_code = nrf_ble_gq_conn_handle_register(&m_ble_gatt_queue, conn_handle);
+      APP_ERROR_CHECK(err_code);
+#endif
+      link_phys = link_phy_preference(p_link->info.role == BLE_GAP_ROLE_CENTRAL);
+      if (link_phys != BLE_GAP_PHY_AUTO) {
+        // Actively request the preferred PHY for the link
+        enrf_phy_update(conn_handle, link_phys);
+      }
+      if (p_link->info.role == BLE_GAP_ROLE_PERIPH) {
+        if (!conn_params_in_range(&p_link->info.conn_params)) {
+          // Request the selected connection parameters right away
+          conn_params_link_update(p_link);
+        }
+        if (m_is_advertising && link_count(BLE_GAP_ROLE_PERIPH) < NRF_SDH_BLE_PERIPHERAL_LINK_COUNT) {
+          // Stay connectable for more centrals
+          adv_phase_start(adv_phase_first(false));
+        }
+      } else {
+        m_connect_handle = conn_handle;
+        p_link->info.disc_state = ENRF_DISC_RUNNING;
+#ifdef ENRF_GATT_CACHE
+        gatt_cache_connect(p_link);
+#else
+        ble_db_discovery_start(&p_link->db_discovery, conn_handle);
+#endif
+      }
+      break;
+
+    case BLE_GAP_EVT_DISCONNECTED:
+      NRF_LOG_DEBUG("Disconnected: handle %d, reason 0x%x.", conn_handle,
+                    p_ble_evt->evt.gap_evt.params.disconnected.reason);
+      if (p_link) {
+        // Try to get the central back quickly unless the link was closed here
+        periph_lost = p_link->info.role == BLE_GAP_ROLE_PERIPH;
+        reconnect = periph_lost && p_ble_evt->evt.gap_evt.params.disconnected.reason !=
+                    BLE_HCI_LOCAL_HOST_TERMINATED_CONNECTION;
+        if (periph_lost) {
+          m_adv_peer_addr = p_link->info.peer_addr;
+        }
+        tx_queue_flush(&p_link->nus_tx);
+        // Pending requests are dropped by the GATT queue, report them as failed
+        while (p_link->gatt_req_cnt) {
+          gatt_req_complete(p_link, p_link->gatt_reqs[p_link->gatt_req_first].char_handle,
+                            BLE_GATT_STATUS_UNKNOWN, NULL, 0);
+        }
+#if ENRF_L2CAP_CHANNELS > 0
+        l2cap_link_close(p_link);
+#endif
+        p_link->conn_handle = BLE_CONN_HANDLE_INVALID;
+      }
+      if (m_is_advertising && periph_lost) {
+        // Only a connection as peripheral stops the set, others leave it running
+        adv_phase_start(adv_phase_first(reconnect));
+      }
+      if (conn_handle == m_connect_handle) {
+        m_connect_handle = BLE_CONN_HANDLE_INVALID;
+        m_disconnected = true;
+      }
+      break;
+
+    case BLE_GAP_EVT_PHY_UPDATE_REQUEST: {
+      NRF_LOG_DEBUG("PHY update request.");
+      link_phys = link_phy_preference(p_link && p_link->info.role == BLE_GAP_ROLE_CENTRAL);
+      ble_gap_phys_t const phys = {
+        .rx_phys = link_phys,
+        .tx_phys = link_phys,
+      };
+      err_code = sd_ble_gap_phy_update(conn_handle, &phys);
+      if (err_code != NRF_SUCCESS) {
+        NRF_LOG_WARNING("PHY update reply failed: 0x%X", err_code);
+      }
+    }
+    break;
+
+    case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
+      // Pairing not supported
+      err_code = sd_ble_gap_sec_params_reply(conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL,
+                                             NULL);
+      APP_ERROR_CHECK(err_code);
+      break;
+
+    case BLE_GAP_EVT_ADV_REPORT: {
+      ble_evt_t *p = (ble_evt_t *)p_ble_evt;
+      ble_gap_evt_t *p_gap_evt = &p->evt.gap_evt;
+      // Fragments of chained data are held back until complete
+      ble_gap_evt_adv_report_t *p_report = adv_chain_reassemble(&p_gap_evt->params.adv_report);
+      if (!m_adv_report_cb || !p_report || !scan_dedup_check(p_report) || !m_adv_report_cb(p_report))
+        if (sd_ble_gap_scan_start(NULL, &m_adv_rep_buffer) != NRF_SUCCESS) {
+          NRF_LOG_ERROR("Failed to restart scanning");
+        }
+      break;
+    }
+
+    case BLE_GAP_EVT_ADV_SET_TERMINATED:
+      if (p_ble_evt->evt.gap_evt.params.adv_set_terminated.reason ==
+          BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT && m_is_advertising) {
+        adv_phase_timeout();
+      }
+      break;
+
+    case BLE_GAP_EVT_TIMEOUT: {
+      const ble_gap_evt_t *p_gap_evt = &p_ble_evt->evt.gap_evt;
+      if (p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_SCAN) {
+        NRF_LOG_ERROR("Scan timed out");
+      } else if (p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_CONN) {
+        NRF_LOG_ERROR("Connection Request timed out");
+      }
+      m_timeout = true;
+      break;
+    }
+
+    case BLE_GATTS_EVT_SYS_ATTR_MISSING:
+      // No system attributes have been stored.
+      err_code = sd_ble_gatts_sys_attr_set(conn_handle, NULL, 0, 0);
+      APP_ERROR_CHECK(err_code);
+      break;
+
+    case BLE_GATTC_EVT_READ_RSP:
+    case BLE_GATTC_EVT_WRITE_RSP: {
+      // Possible completion of a queued request
+      const ble_gattc_evt_t *p_gattc_evt = &p_ble_evt->evt.gattc_evt;
+      bool is_read = p_ble_evt->header.evt_id == BLE_GATTC_EVT_READ_RSP;
+      if (!p_link) {
+        break;
+      }
+      if (p_gattc_evt->gatt_status != BLE_GATT_STATUS_SUCCESS) {
+        gatt_req_complete(p_link, p_gattc_evt->error_handle, p_gattc_evt->gatt_status, NULL, 0);
+      } else if (is_read) {
+        gatt_req_complete(p_link, p_gattc_evt->params.read_rsp.handle, BLE_GATT_STATUS_SUCCESS,
+                          p_gattc_evt->params.read_rsp.data, p_gattc_evt->params.read_rsp.len);
+      } else {
+        gatt_req_complete(p_link, p_gattc_evt->params.write_rsp.handle, BLE_GATT_STATUS_SUCCESS,
+                          p_gattc_evt->params.write_rsp.data, p_gattc_evt->params.write_rsp.len);
+      }
+      break;
+    }
+
+    case BLE_GATTC_EVT_TIMEOUT:
+      // Disconnect on GATT Client timeout event.
+      err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gattc_evt.conn_handle,
+                                       BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+      APP_ERROR_CHECK(err_code);
+      break;
+
+    case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+    case BLE_GATTC_EVT_WRITE_CMD_TX_COMPLETE:
+      // Room for more notifications or writes, top up from the NUS queue of the link
+      if (p_link) {
+        tx_queue_process(p_link);
+      }
+      break;
+
+    case BLE_GATTS_EVT_TIMEOUT:
+      // Disconnect on GATT Server timeout event.
+      err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gatts_evt.conn_handle,
+                                       BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+      APP_ERROR_CHECK(err_code);
+      break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+      if (p_link) {
+        p_link->info.conn_params = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params;
+        NRF_LOG_DEBUG("Connection interval: %d, latency: %d", p_link->info.conn_params.max_conn_interval,
+                      p_link->info.conn_params.slave_latency);
+      }
+      break;
+
+    case BLE_GAP_EVT_CONN_PARAM_UPDATE_REQUEST: {
+      // Accept the parameters requested by the peripheral within the range of the active profile
+      ble_gap_conn_params_t conn_params = p_ble_evt->evt.gap_evt.params.conn_param_update_request.conn_params;
+      conn_params.min_conn_interval = MAX(conn_params.min_conn_interval, m_connection_param.min_conn_interval);
+      conn_params.max_conn_interval = MIN(conn_params.max_conn_interval, m_connection_param.max_conn_interval);
+      if (conn_params.min_conn_interval > conn_params.max_conn_interval) {
+        // No overlap, use the profile as is
+        conn_params = m_connection_param;
+      } else {
+        // The profile timeout is valid for its own max interval and latency
+        conn_params.slave_latency = MIN(conn_params.slave_latency, m_connection_param.slave_latency);
+        conn_params.conn_sup_timeout = m_connection_param.conn_sup_timeout;
+      }
+      err_code = sd_ble_gap_conn_param_update(conn_handle, &conn_params);
+      if (err_code != NRF_SUCCESS) {
+        NRF_LOG_WARNING("Connection parameter update failed: 0x%X", err_code);
+      }
+      break;
+    }
+
+    case BLE_GAP_EVT_DATA_LENGTH_UPDATE: {
+      const ble_gap_data_length_params_t *p_params =
+        &p_ble_evt->evt.gap_evt.params.data_length_update.effective_params;
+      if (p_link) {
+        p_link->info.max_tx_octets = p_params->max_tx_octets;
+        p_link->info.max_rx_octets = p_params->max_rx_octets;
+      }
+      NRF_LOG_DEBUG("Data length updated, tx: %d rx: %d", p_params->max_tx_octets, p_params->max_rx_octets);
+      if (p_link) {
+        link_phy_retry(p_link);
+      }
+      break;
+    }
+
+    case BLE_GAP_EVT_PHY_UPDATE:
+      if (p_link && p_ble_evt->evt.gap_evt.params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS) {
+        p_link->info.tx_phy = p_ble_evt->evt.gap_evt.params.phy_update.tx_phy;
+        p_link->info.rx_phy = p_ble_evt->evt.gap_evt.params.phy_update.rx_phy;
+      }
+      if (p_link) {
+        link_phy_retry(p_link);
+      }
+      break;
+
+    default:
+      break;
+  }
+
+#if ENRF_L2CAP_CHANNELS > 0
+  if (p_link) {
+    l2cap_on_ble_evt(p_link, p_ble_evt);
+  }
+#endif
+
+  if (p_link && p_link->info.role == BLE_GAP_ROLE_CENTRAL) {
+    ble_db_discovery_on_ble_evt(p_ble_evt, &p_link->db_discovery);
+#ifdef ENRF_GATT_CACHE
+    gatt_cache_on_ble_evt(p_link, p_ble_evt);
+#endif
+  }
+
+  if (m_app_evt_cb) {
+    m_app_evt_cb(p_ble_evt, p_context);
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void ble_stack_init(void) {
+  ret_code_t err_code;
+
+  err_code = nrf_sdh_enable_request();
+  APP_ERROR_CHECK(err_code);
+
+  // Configure the BLE stack using the default settings.
+  // Fetch the start address of the application RAM.
+  uint32_t ram_start = 0;
+  err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
+  APP_ERROR_CHECK(err_code);
+
+  // Then adjust the link settings affecting throughput
+  ble_cfg_t ble_cfg;
+  memset(&ble_cfg, 0, sizeof(ble_cfg));
+  ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+  ble_cfg.conn_cfg.params.gap_conn_cfg.conn_count = NRF_SDH_BLE_TOTAL_LINK_COUNT;
+  ble_cfg.conn_cfg.params.gap_conn_cfg.event_length = m_link_config.event_length;
+  err_code = sd_ble_cfg_set(BLE_CONN_CFG_GAP, &ble_cfg, ram_start);
+  APP_ERROR_CHECK(err_code);
+
+  memset(&ble_cfg, 0, sizeof(ble_cfg));
+  ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+  ble_cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = m_link_config.hvn_queue_size;
+  err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &ble_cfg, ram_start);
+  APP_ERROR_CHECK(err_code);
+
+  memset(&ble_cfg, 0, sizeof(ble_cfg));
+  ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+  ble_cfg.conn_cfg.params.gattc_conn_cfg.write_cmd_tx_queue_size = m_link_config.write_cmd_queue_size;
+  err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATTC, &ble_cfg, ram_start);
+  APP_ERROR_CHECK(err_code);
+
+#if ENRF_L2CAP_CHANNELS > 0
+  memset(&ble_cfg, 0, sizeof(ble_cfg));
+  ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+  ble_cfg.conn_cfg.params.l2cap_conn_cfg.rx_mps = ENRF_L2CAP_MPS;
+  ble_cfg.conn_cfg.params.l2cap_conn_cfg.tx_mps = ENRF_L2CAP_MPS;
+  ble_cfg.conn_cfg.params.l2cap_conn_cfg.rx_queue_size = ENRF_L2CAP_RX_BUFS;
+  ble_cfg.conn_cfg.params.l2cap_conn_cfg.tx_queue_size = ENRF_L2CAP_TX_BUFS;
+  ble_cfg.conn_cfg.params.l2cap_conn_cfg.ch_count = ENRF_L2CAP_CHANNELS;
+  err_code = sd_ble_cfg_set(BLE_CONN_CFG_L2CAP, &ble_cfg, ram_start);
+  APP_ERROR_CHECK(err_code);
+#endif
+
+  // Enable BLE stack.
+  // If the configuration requires more RAM than available, the log will show the required
+  // RAM start address. Increase the make variable RAM_REDUC accordingly
+  err_code = nrf_sdh_ble_enable(&ram_start);
+  APP_ERROR_CHECK(err_code);
+
+  // Let connection events extend as long as there is data to transfer
+  ble_opt_t opt;
+  memset(&opt, 0, sizeof(opt));
+  opt.common_opt.conn_evt_ext.enable = m_link_config.conn_evt_ext ? 1 : 0;
+  err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+  APP_ERROR_CHECK(err_code);
+
+  // Register a handler for BLE events.
+  NRF_SDH_BLE_OBSERVER(m_ble_observer, APP_BLE_OBSERVER_PRIO, ble_evt_handler, NULL);
+}
+
+//--------------------------------------------------------------------------
+
+static void gatt_evt_handler(nrf_ble_gatt_t *p_gatt, nrf_ble_gatt_evt_t const *p_evt) {
+  link_t *p_link = link_get(p_evt->conn_handle);
+  if (p_link && (p_evt->evt_id == NRF_BLE_GATT_EVT_ATT_MTU_UPDATED)) {
+    p_link->info.att_mtu = p_evt->params.att_mtu_effective;
+    p_link->nus_max_data_len = p_evt->params.att_mtu_effective - OPCODE_LENGTH - HANDLE_LENGTH;
+    NRF_LOG_DEBUG("Data len is set to 0x%X(%d)", p_link->nus_max_data_len, p_link->nus_max_data_len);
+    link_phy_retry(p_link);
+  }
+  NRF_LOG_DEBUG("ATT MTU exchange completed. central 0x%x peripheral 0x%x",
+                p_gatt->att_mtu_desired_central,
+                p_gatt->att_mtu_desired_periph);
+}
+
+//--------------------------------------------------------------------------
+
+static void gatt_init(void) {
+  ret_code_t err_code;
+  err_code = nrf_ble_gatt_init(&m_gatt, gatt_evt_handler);
+  APP_ERROR_CHECK(err_code);
+  // Negotiate the largest possible MTU and data length on connect, in both roles
+  err_code = nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+  APP_ERROR_CHECK(err_code);
+  err_code = nrf_ble_gatt_att_mtu_central_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+  APP_ERROR_CHECK(err_code);
+  err_code = nrf_ble_gatt_data_length_set(&m_gatt, BLE_CONN_HANDLE_INVALID, NRF_SDH_BLE_GAP_DATA_LENGTH);
+  APP_ERROR_CHECK(err_code);
+}
+
+//--------------------------------------------------------------------------
+
+static void log_init(void) {
+  ret_code_t err_code = NRF_LOG_INIT(NULL);
+  APP_ERROR_CHECK(err_code);
+  NRF_LOG_DEFAULT_BACKENDS_INIT();
+}
+
+//--------------------------------------------------------------------------
+
+static void power_management_init(void) {
+  ret_code_t err_code;
+  err_code = nrf_pwr_mgmt_init();
+  APP_ERROR_CHECK(err_code);
+}
+
+//--------------------------------------------------------------------------
+
+static void db_disc_handler(ble_db_discovery_evt_t *p_evt) {
+  link_t *p_link = link_get(p_evt->conn_handle);
+  if (!p_link) {
+    return;
+  }
+  if (p_link->nus_c_rx_cb) {
+    ble_nus_c_on_db_disc_evt(&m_ble_nus_c[p_evt->conn_handle], p_evt);
+  }
+  if (p_evt->evt_type == BLE_DB_DISCOVERY_AVAILABLE) {
+    p_link->info.disc_state = ENRF_DISC_DONE;
+  }
+#ifdef ENRF_GATT_CACHE
+  gatt_cache_collect(p_link, p_evt);
+#endif
+  if (p_link->disc_cb) {
+    p_link->disc_cb(p_evt);
+  }
+}
+//--------------------------------------------------------------------------
+
+void enrf_set_link_config(const enrf_link_config_t *config) {
+  m_link_config = *config;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_phy_policy(const enrf_phy_policy_t *policy) {
+  m_phy_policy = *policy;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_get_phy_policy(enrf_phy_policy_t *policy) {
+  *policy = m_phy_policy;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_phy(bool long_range) {
+  uint8_t phy = long_range ? BLE_GAP_PHY_CODED : BLE_GAP_PHY_1MBPS;
+  m_phy_policy.adv_primary_phy = phy;
+  m_phy_policy.adv_secondary_phy = phy;
+  m_phy_policy.scan_phys = phy;
+  m_phy_policy.scan_extended = false;
+  m_phy_policy.adv_extended = false;
+  m_phy_policy.conn_phys = phy;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_phy_update(uint16_t conn_handle, uint8_t phys) {
+  link_t *p_link = link_get(conn_handle);
+  if (!p_link) {
+    return NRF_ERROR_INVALID_STATE;
+  }
+  ble_gap_phys_t const gap_phys = {
+    .rx_phys = phys,
+    .tx_phys = phys,
+  };
+  ret_code_t err_code = sd_ble_gap_phy_update(conn_handle, &gap_phys);
+  if (err_code == NRF_ERROR_BUSY) {
+    // Typically the data length or MTU exchange started at connect, requested when done
+    p_link->phy_pending = phys;
+    return NRF_SUCCESS;
+  }
+  p_link->phy_pending = 0;
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+static void link_phy_retry(link_t *p_link) {
+  if (p_link->phy_pending) {
+    ret_code_t err_code = enrf_phy_update(p_link->conn_handle, p_link->phy_pending);
+    if (err_code != NRF_SUCCESS) {
+      NRF_LOG_WARNING("PHY update failed: 0x%X", err_code);
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_tx_power(int tx_power) {
+  m_tx_power = MAX(-40, MIN(8, tx_power));
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t adv_data_encode(uint8_t *p_data, uint8_t size, ble_data_t *p_enc) {
+  // Manufacturer data plus the name and flags given at advertising start
+  static ble_advdata_manuf_data_t manuf_specific_data;
+  ble_advdata_t advdata;
+  memset(&advdata, 0, sizeof(advdata));
+  advdata.name_type = m_adv_name_type;
+  advdata.flags = m_adv_flags;
+  if (p_data != NULL) {
+    manuf_specific_data.company_identifier = m_adv_company_id;
     manuf_specific_data.data.p_data = p_data;
     manuf_specific_data.data.size = size;
     advdata.p_manuf_specific_data = &manuf_specific_data;
   }
+  p_enc->len = ADV_DATA_MAX;
+  return ble_advdata_encode(&advdata, p_enc->p_data, &p_enc->len);
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t adv_data_switch(const ble_data_t *p_enc, const ble_data_t *p_sr) {
+  // Hand over new data to the running advertising set, parameters are kept
+  // Also called by the rotation timer, callers in thread mode use a critical region
+  // The data now on air is kept for the one given as NULL
+  if (!p_enc) {
+    p_enc = &m_adv_data.adv_data;
+  }
+  if (!p_sr) {
+    p_sr = &m_adv_data.scan_rsp_data;
+  }
+  if (!m_adv_extended && p_enc->len > BLE_GAP_ADV_SET_DATA_SIZE_MAX) {
+    // Does not fit the running legacy advertising
+    return NRF_ERROR_DATA_SIZE;
+  }
+  // Neither of the buffers now on air may be passed again
+  ble_gap_adv_data_t adv_data = m_adv_data;
+  adv_data.adv_data.p_data = m_air_advdata[m_air_index];
+  adv_data.adv_data.len = p_enc->len;
+  memcpy(adv_data.adv_data.p_data, p_enc->p_data, p_enc->len);
+  adv_data.scan_rsp_data.p_data = NULL;
+  adv_data.scan_rsp_data.len = p_sr->len;
+  if (p_sr->len) {
+    adv_data.scan_rsp_data.p_data = m_air_srdata[m_air_index];
+    memcpy(adv_data.scan_rsp_data.p_data, p_sr->p_data, p_sr->len);
+  }
+  ret_code_t err_code = sd_ble_gap_adv_set_configure(&m_adv_handle, &adv_data, NULL);
+  if (err_code == NRF_SUCCESS) {
+    m_adv_data = adv_data;
+    m_air_index ^= 1;
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_set_scan_response(const ble_advdata_t *p_srdata) {
+  uint8_t index = m_enc_sr_index ^ 1;
+  ble_data_t enc = {.p_data = NULL, .len = 0};
+  if (p_srdata) {
+    enc.p_data = m_enc_srdata[index];
+    enc.len = sizeof(m_enc_srdata[index]);
+    ret_code_t err_code = ble_advdata_encode(p_srdata, enc.p_data, &enc.len);
+    if (err_code != NRF_SUCCESS) {
+      return err_code;
+    }
+  }
+  ret_code_t err_code = NRF_SUCCESS;
+  // Not to be interrupted by the rotation timer switching the advertising data
+  CRITICAL_REGION_ENTER();
+  if (m_is_advertising && !m_adv_extended) {
+    // Switch while advertising, the advertising data on air is kept
+    err_code = adv_data_switch(NULL, &enc);
+  }
+  if (err_code == NRF_SUCCESS) {
+    m_scan_rsp = enc;
+    m_enc_sr_index = index;
+  }
+  CRITICAL_REGION_EXIT();
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_update_advertise_data(uint8_t *p_data, uint8_t size) {
+  if (!m_is_advertising) {
+    return NRF_ERROR_INVALID_STATE;
+  }
+  // The softdevice keeps using the current buffer until the new one has been configured
+  uint8_t index = m_enc_adv_index ^ 1;
+  ble_data_t enc = {.p_data = m_enc_advdata[index]};
+  ret_code_t err_code = adv_data_encode(p_data, size, &enc);
+  if (err_code != NRF_SUCCESS) {
+    return err_code;
+  }
+  CRITICAL_REGION_ENTER();
+  err_code = adv_data_switch(&enc, NULL);
+  if (err_code == NRF_SUCCESS) {
+    m_adv_slot_on_air = false;
+    m_enc_adv_index = index;
+    m_enc_adv_len = enc.len;
+  }
+  CRITICAL_REGION_EXIT();
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+static void adv_rotation_timeout(void *p_context) {
+  if (m_adv_phase == ADV_PHASE_DIRECTED) {
+    // No data in high duty directed advertising, rotation continues in the next phase
+    return;
+  }
+  if (m_adv_slot_left && --m_adv_slot_left) {
+    return;
+  }
+  // Next used slot, on air for as many periods as its weight
+  for (uint8_t i = 1; i <= ENRF_ADV_ROTATION_SLOTS; i++) {
+    uint8_t slot = (m_adv_slot_current + i) % ENRF_ADV_ROTATION_SLOTS;
+    if (m_adv_slots[slot].weight) {
+      m_adv_slot_left = m_adv_slots[slot].weight;
+      if (slot == m_adv_slot_current && m_adv_slot_on_air) {
+        // The only used slot, already on air
+        break;
+      }
+      ble_data_t enc = {.p_data = m_adv_slots[slot].data, .len = m_adv_slots[slot].len};
+      m_adv_slot_current = slot;
+      ret_code_t err_code = adv_data_switch(&enc, NULL);
+      m_adv_slot_on_air = err_code == NRF_SUCCESS;
+      if (!m_adv_slot_on_air) {
+        // Tried again with the next slot at the next period
+        NRF_LOG_WARNING("Advertising rotation to slot %d failed: 0x%X", slot, err_code);
+        m_adv_slot_left = 0;
+      }
+      break;
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_adv_rotation_add(const ble_advdata_t *p_advdata, uint8_t weight, uint8_t *p_slot) {
+  for (uint8_t slot = 0; slot < ENRF_ADV_ROTATION_SLOTS; slot++) {
+    adv_slot_t *p_adv_slot = &m_adv_slots[slot];
+    if (!p_adv_slot->weight) {
+      // Encoded once here, only copied on air when rotating
+      p_adv_slot->len = sizeof(p_adv_slot->data);
+      ret_code_t err_code = ble_advdata_encode(p_advdata, p_adv_slot->data, &p_adv_slot->len);
+      if (err_code == NRF_SUCCESS) {
+        p_adv_slot->weight = MAX(weight, 1);
+        if (p_slot) {
+          *p_slot = slot;
+        }
+      }
+      return err_code;
+    }
+  }
+  return NRF_ERROR_NO_MEM;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_adv_rotation_start(uint32_t period_ms) {
+  if (!m_is_advertising) {
+    return NRF_ERROR_INVALID_STATE;
+  }
+  if (!m_adv_rotation_created) {
+    app_timer_create(&m_adv_rotation_timer, APP_TIMER_MODE_REPEATED, adv_rotation_timeout);
+    m_adv_rotation_created = true;
+  }
+  app_timer_stop(m_adv_rotation_timer);
+  // Start with the first used slot
+  CRITICAL_REGION_ENTER();
+  m_adv_slot_current = ENRF_ADV_ROTATION_SLOTS - 1;
+  m_adv_slot_left = 0;
+  m_adv_slot_on_air = false;
+  adv_rotation_timeout(NULL);
+  CRITICAL_REGION_EXIT();
+  return app_timer_start(m_adv_rotation_timer, APP_TIMER_TICKS(period_ms), NULL);
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_adv_rotation_stop(bool clear) {
+  if (m_adv_rotation_created) {
+    app_timer_stop(m_adv_rotation_timer);
+  }
+  if (clear) {
+    // A timeout may already be pending
+    CRITICAL_REGION_ENTER();
+    if (m_adv_slot_on_air) {
+      // Back to the ordinary data
+      ble_data_t enc = {.p_data = m_enc_advdata[m_enc_adv_index], .len = m_enc_adv_len};
+      adv_data_switch(&enc, NULL);
+      m_adv_slot_on_air = false;
+    }
+    for (uint8_t slot = 0; slot < ENRF_ADV_ROTATION_SLOTS; slot++) {
+      m_adv_slots[slot].weight = 0;
+    }
+    CRITICAL_REGION_EXIT();
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static bool adv_fast_phase() {
+  return m_adv_policy.fast_interval_ms && m_adv_policy.fast_duration_s;
+}
+
+//--------------------------------------------------------------------------
+
+static adv_phase_t adv_phase_first(bool reconnect) {
+  // High duty directed advertising only exists for legacy connectable advertising
+  if (reconnect && m_adv_policy.directed_reconnect && !m_adv_extended &&
+      m_adv_params.properties.type == BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED) {
+    return ADV_PHASE_DIRECTED;
+  }
+  return adv_fast_phase() ? ADV_PHASE_FAST : ADV_PHASE_SLOW;
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t adv_phase_configure(adv_phase_t phase) {
+  // The parameters in m_adv_params are used as base for all phases
+  ble_gap_adv_params_t params = m_adv_params;
+  ble_gap_adv_data_t adv_data = m_adv_data;
+  uint32_t interval_ms = m_adv_interval_ms;
+  uint32_t duration_s = m_adv_timeout_s;
+  if (phase == ADV_PHASE_DIRECTED) {
+    // No data, the duration is limited to 1.28 s by the softdevice
+    params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_NONSCANNABLE_DIRECTED_HIGH_DUTY_CYCLE;
+    params.p_peer_addr = &m_adv_peer_addr;
+    params.interval = 0;
+    params.duration = BLE_GAP_ADV_TIMEOUT_HIGH_DUTY_MAX;
+    memset(&adv_data, 0, sizeof(adv_data));
+  } else {
+    if (phase == ADV_PHASE_FAST) {
+      interval_ms = m_adv_policy.fast_interval_ms;
+      duration_s = m_adv_timeout_s ? MIN(m_adv_timeout_s, m_adv_policy.fast_duration_s) :
+                   m_adv_policy.fast_duration_s;
+    } else if (m_adv_timeout_s && adv_fast_phase()) {
+      // The total timeout includes the fast phase
+      duration_s = m_adv_timeout_s - MIN(m_adv_timeout_s, m_adv_policy.fast_duration_s);
+    }
+    params.interval = MSEC_TO_UNITS(interval_ms, UNIT_0_625_MS);
+    params.duration = duration_s * 100;
+  }
+  ret_code_t err_code = sd_ble_gap_adv_set_configure(&m_adv_handle, &adv_data, &params);
+  if (err_code == NRF_SUCCESS) {
+    m_adv_phase = phase;
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t adv_phase_start(adv_phase_t phase) {
+  // Parameters can only be changed when stopped, stop fails if not running
+  sd_ble_gap_adv_stop(m_adv_handle);
+  ret_code_t err_code = adv_phase_configure(phase);
+  if (err_code == NRF_SUCCESS) {
+    err_code = sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+static void adv_phase_timeout() {
+  NRF_LOG_DEBUG("Advertising phase %d ended", m_adv_phase);
+  if (m_adv_phase == ADV_PHASE_DIRECTED) {
+    adv_phase_start(adv_fast_phase() ? ADV_PHASE_FAST : ADV_PHASE_SLOW);
+  } else if (m_adv_phase == ADV_PHASE_FAST &&
+             (!m_adv_timeout_s || m_adv_timeout_s > m_adv_policy.fast_duration_s)) {
+    adv_phase_start(ADV_PHASE_SLOW);
+  } else {
+    // Total timeout reached
+    m_is_advertising = false;
+    enrf_adv_rotation_stop(false);
+  }
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_adv_policy(const enrf_adv_policy_t *policy) {
+  m_adv_policy = *policy;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_get_adv_policy(enrf_adv_policy_t *policy) {
+  *policy = m_adv_policy;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_start_advertise(bool connectable,
+                                uint16_t company_id, ble_advdata_name_type_t type,
+                                uint8_t *p_data, uint8_t size,
+                                uint32_t interval_ms, uint32_t timeout_s,
+                                nus_rx_cb_t nus_cb) {
+  uint32_t err_code;
+
+  enrf_stop_advertise(m_adv_handle);
+
+  m_app_nus_rec_cb = nus_cb;
+
+  // Set advertisement data
+  m_adv_name_type = type;
+  m_adv_flags = connectable ? BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE :
+                BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
+  m_adv_company_id = company_id;
+
+  m_adv_slot_on_air = false;
+  m_adv_data.adv_data.p_data = m_enc_advdata[m_enc_adv_index];
+  err_code = adv_data_encode(p_data, size, &m_adv_data.adv_data);
+  if (err_code != NRF_SUCCESS) {
+    return err_code;
+  }
+  m_enc_adv_len = m_adv_data.adv_data.len;
+
+  // Set advertisement parameters
+  memset(&m_adv_params, 0, sizeof(m_adv_params));
+  // Extended advertising required for other PHYs than 1M and for more than 31 bytes
+  m_adv_extended = m_phy_policy.adv_extended ||
+                   m_phy_policy.adv_primary_phy != BLE_GAP_PHY_1MBPS ||
+                   m_phy_policy.adv_secondary_phy != BLE_GAP_PHY_1MBPS ||
+                   m_enc_adv_len > BLE_GAP_ADV_SET_DATA_SIZE_MAX;
+  if (m_adv_extended) {
+    m_adv_params.properties.type =
+      connectable ? BLE_GAP_ADV_TYPE_EXTENDED_CONNECTABLE_NONSCANNABLE_UNDIRECTED :
+      BLE_GAP_ADV_TYPE_EXTENDED_NONCONNECTABLE_NONSCANNABLE_UNDIRECTED;
+  } else {
+    m_adv_params.properties.type =
+      connectable ? BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED :
+      BLE_GAP_ADV_TYPE_NONCONNECTABLE_SCANNABLE_UNDIRECTED;
+  }
+  m_adv_params.primary_phy = m_phy_policy.adv_primary_phy;
+  m_adv_params.secondary_phy = m_phy_policy.adv_secondary_phy;
+  m_adv_params.filter_policy = BLE_GAP_ADV_FP_ANY;
+  m_adv_interval_ms = interval_ms;
+  m_adv_timeout_s = timeout_s;
+  if (m_adv_extended) {
+    m_adv_data.scan_rsp_data.p_data = NULL;
+    m_adv_data.scan_rsp_data.len = 0;
+  } else {
+    m_adv_data.scan_rsp_data = m_scan_rsp;
+  }
+  // Connectable extended advertising holds less data, given as error here
+  err_code = adv_phase_configure(adv_phase_first(false));
+  if (err_code != NRF_SUCCESS) {
+    return err_code;
+  }
+
+  // And transmission output power
+  err_code = sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_ADV, m_adv_handle, m_tx_power);
+  APP_ERROR_CHECK(err_code);
+
+  NRF_LOG_DEBUG("Advertising set, phy: %d/%d, tx: %d dBm", m_adv_params.primary_phy,
+                m_adv_params.secondary_phy, m_tx_power);
+  err_code = sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
+  m_is_advertising = err_code == NRF_SUCCESS;
+
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_stop_advertise() {
+  m_is_advertising = false;
+  enrf_adv_rotation_stop(false);
+  return sd_ble_gap_adv_stop(m_adv_handle);
+}
+
+//--------------------------------------------------------------------------
+
+bool enrf_is_advertising() {
+  return m_is_advertising;
+}
+
+//--------------------------------------------------------------------------
+
+bool enrf_is_connected(uint16_t conn_handle) {
+  if (conn_handle == BLE_CONN_HANDLE_ALL) {
+    return enrf_get_conn_handles(NULL, 0) > 0;
+  }
+  return link_get(conn_handle) != NULL;
+}
+
+//--------------------------------------------------------------------------
+
+uint8_t enrf_get_conn_handles(uint16_t *conn_handles, uint8_t max_count) {
+  uint8_t cnt = 0;
+  for (uint16_t i = 0; i < NRF_SDH_BLE_TOTAL_LINK_COUNT; i++) {
+    if (link_get(i)) {
+      if (cnt < max_count) {
+        conn_handles[cnt] = i;
+      }
+      cnt++;
+    }
+  }
+  return cnt;
+}
 
-  m_adv_data.adv_data.len = sizeof(m_enc_advdata);
+//--------------------------------------------------------------------------
 
-  // Set advertisement parameters
-  memset(&m_adv_params, 0, sizeof(m_adv_params));
-  if (m_long_range) {
-    m_adv_params.properties.type =
-      connectable ? BLE_GAP_ADV_TYPE_EXTENDED_CONNECTABLE_NONSCANNABLE_UNDIRECTED :
-      BLE_GAP_ADV_TYPE_EXTENDED_NONCONNECTABLE_NONSCANNABLE_UNDIRECTED;
-    m_adv_params.primary_phy = BLE_GAP_PHY_CODED;
-    m_adv_params.secondary_phy = BLE_GAP_PHY_CODED;
-  } else {
-    m_adv_params.properties.type =
-      connectable ? BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED :
-      BLE_GAP_ADV_TYPE_NONCONNECTABLE_SCANNABLE_UNDIRECTED;
-    m_adv_params.primary_phy = BLE_GAP_PHY_1MBPS;
-    m_adv_params.secondary_phy = BLE_GAP_PHY_1MBPS;
+ret_code_t enrf_get_link_info(uint16_t conn_handle, enrf_link_info_t *info) {
+  link_t *p_link = link_get(conn_handle);
+  if (!p_link) {
+    return NRF_ERROR_INVALID_STATE;
   }
-  m_adv_params.filter_policy = BLE_GAP_ADV_FP_ANY;
-  m_adv_params.interval = MSEC_TO_UNITS(interval_ms, UNIT_0_625_MS);
-  m_adv_params.duration = timeout_s * 100;
-  err_code = ble_advdata_encode(&advdata, m_adv_data.adv_data.p_data, &m_adv_data.adv_data.len);
-  APP_ERROR_CHECK(err_code);
-  err_code = sd_ble_gap_adv_set_configure(&m_adv_handle, &m_adv_data, &m_adv_params);
-  APP_ERROR_CHECK(err_code);
+  *info = p_link->info;
+  info->nus_rx_handle = m_ble_nus_c[conn_handle].handles.nus_rx_handle;
+  info->nus_tx_handle = m_ble_nus_c[conn_handle].handles.nus_tx_handle;
+  return NRF_SUCCESS;
+}
 
-  // And transmission output power
-  err_code = sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_ADV, m_adv_handle, m_tx_power);
-  APP_ERROR_CHECK(err_code);
+//--------------------------------------------------------------------------
 
-  m_is_central = false;
+static uint32_t tx_queue_used(tx_queue_t *q) {
+  return q->wr_pos - q->rd_pos;
+}
 
-  NRF_LOG_DEBUG("Advertising set, lr: %d, tx: %d dBm", m_long_range, m_tx_power);
-  err_code = sd_ble_gap_adv_start(m_adv_handle, APP_BLE_CONN_CFG_TAG);
-  m_is_advertising = err_code == NRF_SUCCESS;
+//--------------------------------------------------------------------------
 
-  return err_code;
+static uint32_t tx_queue_free(tx_queue_t *q) {
+  uint32_t free = q->size - tx_queue_used(q);
+  return free > sizeof(q->msg_left) ? free - sizeof(q->msg_left) : 0;
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_stop_advertise() {
-  m_is_advertising = false;
-  return sd_ble_gap_adv_stop(m_adv_handle);
+static void tx_queue_copy(tx_queue_t *q, uint32_t pos, uint8_t *dest, const uint8_t *src, uint32_t len) {
+  // Copy to or from the queue buffer, handling wrap around
+  uint32_t offs = pos & (q->size - 1);
+  uint32_t first = MIN(len, q->size - offs);
+  if (dest) {
+    memcpy(dest, q->buffer + offs, first);
+    memcpy(dest + first, q->buffer, len - first);
+  } else {
+    memcpy(q->buffer + offs, src, first);
+    memcpy(q->buffer, src + first, len - first);
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void tx_queue_flush(tx_queue_t *q) {
+  CRITICAL_REGION_ENTER();
+  q->rd_pos = q->wr_pos;
+  q->msg_left = 0;
+  q->above_watermark = false;
+  CRITICAL_REGION_EXIT();
 }
 
 //--------------------------------------------------------------------------
 
-bool enrf_is_connected() {
-  return m_conn_handle != BLE_CONN_HANDLE_INVALID;
+static ret_code_t tx_queue_process(link_t *p_link) {
+  // Fill the softdevice queue from the transmit queue of the link until it is full
+  static uint8_t packet[NRF_SDH_BLE_GATT_MAX_MTU_SIZE];
+  tx_queue_t *q = &p_link->nus_tx;
+  ret_code_t err_code = NRF_SUCCESS;
+  bool notify = false;
+  uint32_t queued;
+  CRITICAL_REGION_ENTER();
+  while (p_link->conn_handle != BLE_CONN_HANDLE_INVALID && tx_queue_used(q) && err_code == NRF_SUCCESS) {
+    if (!q->msg_left) {
+      tx_queue_copy(q, q->rd_pos, (uint8_t *)&q->msg_left, NULL, sizeof(q->msg_left));
+      q->rd_pos += sizeof(q->msg_left);
+    }
+    uint16_t len = MIN(q->msg_left, p_link->nus_max_data_len);
+    tx_queue_copy(q, q->rd_pos, packet, NULL, len);
+    err_code = q->send(p_link->conn_handle, packet, &len);
+    if (err_code == NRF_SUCCESS) {
+      q->rd_pos += len;
+      q->msg_left -= len;
+    }
+  }
+  if (err_code != NRF_SUCCESS && err_code != NRF_ERROR_RESOURCES) {
+    // Not possible to send, drop the queued data
+    NRF_LOG_ERROR("NUS send failed: 0x%X", err_code);
+    tx_queue_flush(q);
+  }
+  queued = tx_queue_used(q);
+  if (q->above_watermark && queued <= q->notify->low_watermark) {
+    q->above_watermark = false;
+    notify = true;
+  }
+  CRITICAL_REGION_EXIT();
+  if (notify && q->notify->cb) {
+    q->notify->cb(p_link->conn_handle, queued);
+  }
+  return err_code == NRF_ERROR_RESOURCES ? NRF_SUCCESS : err_code;
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_nus_data_send(const uint8_t *data, uint32_t length) {
+static ret_code_t tx_queue_put(link_t *p_link, const uint8_t *data, uint32_t length) {
+  if (!length) {
+    return NRF_SUCCESS;
+  }
+  if (!p_link) {
+    return NRF_ERROR_INVALID_STATE;
+  }
+  tx_queue_t *q = &p_link->nus_tx;
+  if (length > UINT16_MAX || length + sizeof(q->msg_left) > q->size) {
+    return NRF_ERROR_INVALID_LENGTH;
+  }
   ret_code_t err_code = NRF_SUCCESS;
-  while (length) {
-    uint16_t curr = MIN(m_ble_nus_max_data_len, length);
-    do {
-      err_code = ble_nus_data_send(&m_nus, (uint8_t *)data, &curr, m_conn_handle);
-    } while (err_code == NRF_ERROR_RESOURCES);
-    length -= curr;
-    data += curr;
+  CRITICAL_REGION_ENTER();
+  if (length > tx_queue_free(q)) {
+    err_code = NRF_ERROR_NO_MEM;
+  } else {
+    uint16_t msg_len = length;
+    tx_queue_copy(q, q->wr_pos, NULL, (const uint8_t *)&msg_len, sizeof(msg_len));
+    tx_queue_copy(q, q->wr_pos + sizeof(msg_len), NULL, data, length);
+    q->wr_pos += sizeof(msg_len) + length;
+    q->above_watermark = q->above_watermark || tx_queue_used(q) > q->notify->low_watermark;
+  }
+  CRITICAL_REGION_EXIT();
+  if (err_code == NRF_SUCCESS) {
+    err_code = tx_queue_process(p_link);
   }
   return err_code;
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_nus_string_send(const char *str) {
-  return enrf_nus_data_send((uint8_t *)str, strlen(str) + 1);
+static ret_code_t nus_send(uint16_t conn_handle, uint8_t *data, uint16_t *length) {
+  return ble_nus_data_send(&m_nus, data, length, conn_handle);
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_nus_tx_callback(nus_tx_cb_t cb, uint32_t low_watermark) {
+  m_nus_tx_notify.cb = cb;
+  m_nus_tx_notify.low_watermark = low_watermark;
+}
+
+//--------------------------------------------------------------------------
+
+uint32_t enrf_nus_tx_free(uint16_t conn_handle) {
+  link_t *p_link = link_get_role(conn_handle, BLE_GAP_ROLE_PERIPH);
+  return p_link ? tx_queue_free(&p_link->nus_tx) : 0;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_nus_data_send(uint16_t conn_handle, const uint8_t *data, uint32_t length) {
+  return tx_queue_put(link_get_role(conn_handle, BLE_GAP_ROLE_PERIPH), data, length);
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_nus_string_send(uint16_t conn_handle, const char *str) {
+  return enrf_nus_data_send(conn_handle, (uint8_t *)str, strlen(str) + 1);
+}
+
+//--------------------------------------------------------------------------
+
+static uint32_t fnv1a_hash(uint32_t hash, const uint8_t *data, uint16_t len) {
+  while (len--) {
+    hash = (hash ^ *data++) * 16777619UL;
+  }
+  return hash;
+}
+
+//--------------------------------------------------------------------------
+
+static adv_chain_t *adv_chain_get(const ble_gap_evt_adv_report_t *p_adv_report, bool alloc) {
+  adv_chain_t *p_oldest = NULL;
+  for (uint8_t i = 0; i < ENRF_ADV_CHAIN_BUFS; i++) {
+    adv_chain_t *p_chain = &m_adv_chains[i];
+    if (p_chain->used && p_chain->set_id == p_adv_report->set_id &&
+        p_chain->data_id == p_adv_report->data_id &&
+        p_chain->peer_addr.addr_type == p_adv_report->peer_addr.addr_type &&
+        memcmp(p_chain->peer_addr.addr, p_adv_report->peer_addr.addr, BLE_GAP_ADDR_LEN) == 0) {
+      return p_chain;
+    }
+    if (!p_oldest || (p_oldest->used && (!p_chain->used || p_chain->seq < p_oldest->seq))) {
+      p_oldest = p_chain;
+    }
+  }
+  if (!alloc || !p_oldest) {
+    return NULL;
+  }
+  if (p_oldest->used) {
+    // Out of buffers, give up the chain that has waited the longest
+    m_adv_chain_stats.dropped++;
+  }
+  p_oldest->used = true;
+  p_oldest->peer_addr = p_adv_report->peer_addr;
+  p_oldest->set_id = p_adv_report->set_id;
+  p_oldest->data_id = p_adv_report->data_id;
+  p_oldest->seq = m_adv_chain_seq++;
+  p_oldest->len = 0;
+  return p_oldest;
+}
+
+//--------------------------------------------------------------------------
+
+static ble_gap_evt_adv_report_t *adv_chain_reassemble(ble_gap_evt_adv_report_t *p_adv_report) {
+  // Returns the report to deliver, NULL while more data is expected
+  uint8_t status = p_adv_report->type.status;
+  if (!p_adv_report->type.extended_pdu) {
+    return p_adv_report;
+  }
+  adv_chain_t *p_chain = adv_chain_get(p_adv_report, status == BLE_GAP_ADV_DATA_STATUS_INCOMPLETE_MORE_DATA);
+  if (!p_chain) {
+    // Single report, or a chain which could not be collected
+    if (status == BLE_GAP_ADV_DATA_STATUS_INCOMPLETE_TRUNCATED ||
+        status == BLE_GAP_ADV_DATA_STATUS_INCOMPLETE_MISSED) {
+      m_adv_chain_stats.truncated++;
+    }
+    return p_adv_report;
+  }
+  uint16_t len = MIN(p_adv_report->data.len, sizeof(p_chain->data) - p_chain->len);
+  memcpy(p_chain->data + p_chain->len, p_adv_report->data.p_data, len);
+  p_chain->len += len;
+  if (len < p_adv_report->data.len) {
+    status = BLE_GAP_ADV_DATA_STATUS_INCOMPLETE_TRUNCATED;
+  } else if (status == BLE_GAP_ADV_DATA_STATUS_INCOMPLETE_MORE_DATA) {
+    return NULL;
+  }
+  // Deliver the collected data with the properties of the last report
+  p_chain->used = false;
+  if (status == BLE_GAP_ADV_DATA_STATUS_COMPLETE) {
+    m_adv_chain_stats.complete++;
+  } else {
+    m_adv_chain_stats.truncated++;
+  }
+  m_adv_chain_report = *p_adv_report;
+  m_adv_chain_report.type.status = status;
+  m_adv_chain_report.data.p_data = p_chain->data;
+  m_adv_chain_report.data.len = p_chain->len;
+  return &m_adv_chain_report;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_get_adv_chain_stats(enrf_adv_chain_stats_t *stats) {
+  *stats = m_adv_chain_stats;
+}
+
+//--------------------------------------------------------------------------
+
+static bool scan_dedup_check(ble_gap_evt_adv_report_t *p_adv_report) {
+  // Returns true if the report is to be delivered
+  if (!m_scan_dedup || p_adv_report->type.status != BLE_GAP_ADV_DATA_STATUS_COMPLETE) {
+    // Partial extended advertising data is always passed on
+    m_scan_stats.rssi_avg = m_scan_stats.rssi_min = m_scan_stats.rssi_max = p_adv_report->rssi;
+    m_scan_stats.count = 1;
+    return true;
+  }
+  const ble_gap_addr_t *p_addr = &p_adv_report->peer_addr;
+  bool scan_rsp = p_adv_report->type.scan_response;
+  uint32_t now = app_timer_cnt_get();
+  uint32_t index = fnv1a_hash(2166136261UL ^ scan_rsp, p_addr->addr, BLE_GAP_ADDR_LEN);
+  uint32_t data_hash = fnv1a_hash(2166136261UL, p_adv_report->data.p_data, p_adv_report->data.len);
+  scan_dev_t *p_dev = NULL;
+  scan_dev_t *p_oldest = NULL;
+  for (uint8_t i = 0; i < SCAN_DEDUP_PROBES && !p_dev; i++) {
+    scan_dev_t *p_slot = &m_scan_devs[(index + i) & (ENRF_SCAN_DEDUP_SIZE - 1)];
+    if (!p_slot->used) {
+      p_oldest = p_slot;
+      break;
+    } else if (p_slot->addr_type == p_addr->addr_type && p_slot->scan_rsp == scan_rsp &&
+               memcmp(p_slot->addr, p_addr->addr, BLE_GAP_ADDR_LEN) == 0) {
+      p_dev = p_slot;
+    } else if (!p_oldest || app_timer_cnt_diff_compute(now, p_slot->last_seen) >
+               app_timer_cnt_diff_compute(now, p_oldest->last_seen)) {
+      p_oldest = p_slot;
+    }
+  }
+  bool report;
+  if (p_dev) {
+    report = p_dev->data_hash != data_hash ||
+             (m_scan_report_ticks && app_timer_cnt_diff_compute(now, p_dev->last_report) >= m_scan_report_ticks);
+  } else {
+    // New device, replacing a free or the least recently seen one in the probed range
+    p_dev = p_oldest;
+    memset(p_dev, 0, sizeof(*p_dev));
+    p_dev->used = true;
+    p_dev->addr_type = p_addr->addr_type;
+    memcpy(p_dev->addr, p_addr->addr, BLE_GAP_ADDR_LEN);
+    p_dev->scan_rsp = scan_rsp;
+    report = true;
+  }
+  p_dev->last_seen = now;
+  p_dev->data_hash = data_hash;
+  if (!p_dev->rssi_cnt || p_adv_report->rssi < p_dev->rssi_min) {
+    p_dev->rssi_min = p_adv_report->rssi;
+  }
+  if (!p_dev->rssi_cnt || p_adv_report->rssi > p_dev->rssi_max) {
+    p_dev->rssi_max = p_adv_report->rssi;
+  }
+  p_dev->rssi_sum += p_adv_report->rssi;
+  p_dev->rssi_cnt++;
+  if (report) {
+    // Deliver the aggregated values and start over
+    m_scan_stats.rssi_avg = p_dev->rssi_sum / p_dev->rssi_cnt;
+    m_scan_stats.rssi_min = p_dev->rssi_min;
+    m_scan_stats.rssi_max = p_dev->rssi_max;
+    m_scan_stats.count = p_dev->rssi_cnt;
+    p_adv_report->rssi = m_scan_stats.rssi_avg;
+    p_dev->last_report = now;
+    p_dev->rssi_sum = 0;
+    p_dev->rssi_cnt = 0;
+  }
+  return report;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_scan_dedup(bool enable, uint32_t report_interval_ms) {
+  m_scan_dedup = enable;
+  m_scan_report_ticks = APP_TIMER_TICKS(report_interval_ms);
+  memset(m_scan_devs, 0, sizeof(m_scan_devs));
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_get_scan_stats(enrf_scan_stats_t *stats) {
+  *stats = m_scan_stats;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_set_accept_list(const ble_gap_addr_t *addrs, uint8_t count, bool filter_scan) {
+  const ble_gap_addr_t *addr_ptrs[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
+  if (count > BLE_GAP_WHITELIST_ADDR_MAX_COUNT) {
+    return NRF_ERROR_DATA_SIZE;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    m_accept_addrs[i] = addrs[i];
+    addr_ptrs[i] = &m_accept_addrs[i];
+  }
+  ret_code_t err_code = sd_ble_gap_whitelist_set(count ? addr_ptrs : NULL, count);
+  m_accept_cnt = err_code == NRF_SUCCESS ? count : 0;
+  m_accept_scan = filter_scan;
+  return err_code;
 }
 
 //--------------------------------------------------------------------------
 
 void enrf_set_scan_par(uint16_t scan_int, uint16_t scan_wind) {
   m_scan_params.interval = scan_int;
-  m_scan_params.window = scan_wind;
+  m_scan_window = scan_wind;
+}
+
+//--------------------------------------------------------------------------
+
+static void scan_params_phys(uint8_t phys, bool extended) {
+  m_scan_params.scan_phys = phys;
+  m_scan_params.extended = (extended || (phys & BLE_GAP_PHY_CODED)) ? 1 : 0;
+  if ((phys & BLE_GAP_PHY_1MBPS) && (phys & BLE_GAP_PHY_CODED)) {
+    // Both PHYs are scanned one window each per interval
+    m_scan_params.window = MIN(m_scan_window, m_scan_params.interval / 2);
+  } else {
+    m_scan_params.window = m_scan_window;
+  }
 }
 
 //--------------------------------------------------------------------------
@@ -595,12 +2522,17 @@ void enrf_set_scan_par(uint16_t scan_int, uint16_t scan_wind) {
 ret_code_t enrf_start_scan(scan_report_cb_t report_cb, uint32_t timeout_s, bool active) {
   sd_ble_gap_scan_stop();
   m_scan_params.active = active ? 1 : 0;
-  m_scan_params.extended = m_long_range ? 1 : 0;
   m_scan_params.timeout = timeout_s * 100;
-  m_scan_params.scan_phys = m_long_range ? BLE_GAP_PHY_CODED : BLE_GAP_PHY_AUTO;
-  m_scan_params.filter_policy = BLE_GAP_SCAN_FP_ACCEPT_ALL;
+  scan_params_phys(m_phy_policy.scan_phys, m_phy_policy.scan_extended);
+  m_scan_params.filter_policy = m_accept_scan && m_accept_cnt ? BLE_GAP_SCAN_FP_WHITELIST :
+                                BLE_GAP_SCAN_FP_ACCEPT_ALL;
   sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_SCAN_INIT, 0, m_tx_power);
   m_adv_report_cb = report_cb;
+  // All devices are reported again in a new scan
+  memset(m_scan_devs, 0, sizeof(m_scan_devs));
+  for (uint8_t i = 0; i < ENRF_ADV_CHAIN_BUFS; i++) {
+    m_adv_chains[i].used = false;
+  }
   return sd_ble_gap_scan_start(&m_scan_params, &m_adv_rep_buffer);
 }
 
@@ -612,69 +2544,122 @@ ret_code_t enrf_stop_scan() {
 
 //--------------------------------------------------------------------------
 
+static bool adv_next_field(const uint8_t *data, uint16_t len, uint16_t *p_offset, uint8_t *p_type,
+                           uint8_t *p_field_len) {
+  // Step to the next AD structure, only returning fields completely within the data
+  uint16_t offset = *p_offset;
+  if (offset + 2 > len || data[offset] == 0 || offset + 1 + data[offset] > len) {
+    // End, zero length padding or malformed
+    return false;
+  }
+  *p_type = data[offset + 1];
+  *p_field_len = data[offset] - 1;
+  *p_offset = offset + 1 + data[offset];
+  return true;
+}
+
+//--------------------------------------------------------------------------
+
 uint8_t enrf_adv_parse(ble_gap_evt_adv_report_t *p_adv_report,
                        uint8_t start_tag, uint8_t end_tag,
                        uint8_t *dest, uint8_t dest_len) {
-  size_t offset;
-  offset = 0;
-  while (offset < p_adv_report->data.len) {
-    uint8_t field_len = p_adv_report->data.p_data[offset];
-    uint8_t field_type = p_adv_report->data.p_data[offset + 1];
-
-    if (offset + field_len > p_adv_report->data.len) {
-      return 0;
-    }
-
-    if (field_type >= start_tag && field_type <= end_tag) {
-      uint8_t len = field_len - 1;
+  uint16_t offset = 0;
+  uint8_t type;
+  uint8_t len;
+  while (adv_next_field(p_adv_report->data.p_data, p_adv_report->data.len, &offset, &type, &len)) {
+    if (type >= start_tag && type <= end_tag) {
       if (len > dest_len) {
         return 0;
       }
-      memcpy(dest, &(p_adv_report->data.p_data[offset + 2]), len);
+      memcpy(dest, p_adv_report->data.p_data + offset - len, len);
       return len;
     }
-    offset += field_len + 1;
   }
   return 0;
 }
 
 //--------------------------------------------------------------------------
 
+uint8_t enrf_adv_index(const ble_gap_evt_adv_report_t *p_adv_report, enrf_adv_index_t *index) {
+  uint16_t offset = 0;
+  uint8_t type;
+  uint8_t len;
+  index->p_data = p_adv_report->data.p_data;
+  index->count = 0;
+  while (index->count < ENRF_ADV_INDEX_MAX &&
+         adv_next_field(p_adv_report->data.p_data, p_adv_report->data.len, &offset, &type, &len)) {
+    index->fields[index->count].type = type;
+    index->fields[index->count].len = len;
+    index->fields[index->count].offset = offset - len;
+    index->count++;
+  }
+  return index->count;
+}
+
+//--------------------------------------------------------------------------
+
+const uint8_t *enrf_adv_index_find(const enrf_adv_index_t *index, uint8_t start_tag, uint8_t end_tag,
+                                   uint8_t *len) {
+  for (uint8_t i = 0; i < index->count; i++) {
+    if (index->fields[i].type >= start_tag && index->fields[i].type <= end_tag) {
+      *len = index->fields[i].len;
+      return index->p_data + index->fields[i].offset;
+    }
+  }
+  *len = 0;
+  return NULL;
+}
+
+//--------------------------------------------------------------------------
+
 void enrf_set_connection_params(float min_con_int_ms, float max_con_int_ms, uint16_t slave_latency,
                                 float sup_timeout_ms) {
   m_connection_param.min_conn_interval = MSEC_TO_UNITS(min_con_int_ms, UNIT_1_25_MS);
   m_connection_param.max_conn_interval = MSEC_TO_UNITS(max_con_int_ms, UNIT_1_25_MS);
   m_connection_param.slave_latency = slave_latency;
   m_connection_param.conn_sup_timeout = MSEC_TO_UNITS(sup_timeout_ms, UNIT_10_MS);
+  conn_params_update();
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_set_conn_profile(enrf_conn_profile_t profile) {
+  if (profile >= ARRAY_SIZE(m_conn_profiles)) {
+    return NRF_ERROR_INVALID_PARAM;
+  }
+  m_connection_param = m_conn_profiles[profile];
+  return conn_params_update();
 }
 
 //--------------------------------------------------------------------------
 
 static void ble_nus_c_evt_handler(ble_nus_c_t *p_ble_nus_c, const ble_nus_c_evt_t *p_ble_nus_evt) {
   uint32_t err_code;
+  uint16_t conn_handle = p_ble_nus_evt->conn_handle;
+  link_t *p_link = link_get(conn_handle);
+  nus_c_rx_cb_t rx_cb = p_link ? p_link->nus_c_rx_cb : NULL;
   switch (p_ble_nus_evt->evt_type) {
     case BLE_NUS_C_EVT_DISCOVERY_COMPLETE:
       // UART service detected
-      err_code = ble_nus_c_handles_assign(p_ble_nus_c, p_ble_nus_evt->conn_handle,
-                                          &p_ble_nus_evt->handles);
+      err_code = ble_nus_c_handles_assign(p_ble_nus_c, conn_handle, &p_ble_nus_evt->handles);
       APP_ERROR_CHECK(err_code);
       err_code = ble_nus_c_tx_notif_enable(p_ble_nus_c);
       APP_ERROR_CHECK(err_code);
-      if (m_nus_c_rx_cb) {
-        m_nus_c_rx_cb(NULL, 1);
+      if (rx_cb) {
+        rx_cb(conn_handle, NULL, 1);
       }
       break;
 
     case BLE_NUS_C_EVT_NUS_TX_EVT:
       // UART response received
-      if (m_nus_c_rx_cb) {
-        m_nus_c_rx_cb(p_ble_nus_evt->p_data, p_ble_nus_evt->data_len);
+      if (rx_cb) {
+        rx_cb(conn_handle, p_ble_nus_evt->p_data, p_ble_nus_evt->data_len);
       }
       break;
 
     case BLE_NUS_C_EVT_DISCONNECTED:
-      if (m_nus_c_rx_cb) {
-        m_nus_c_rx_cb(NULL, 0);
+      if (rx_cb) {
+        rx_cb(conn_handle, NULL, 0);
       }
       break;
   }
@@ -687,120 +2672,293 @@ static ret_code_t enrf_connect(ble_gap_addr_t *addr,
                                nus_c_rx_cb_t nus_c_rx_cb,
                                uint32_t timeout_s) {
   static bool nus_init = false;
+  // Taken over by the link when connected
   m_disc_cb = disc_cb;
   m_nus_c_rx_cb = nus_c_rx_cb;
   if (nus_c_rx_cb && !nus_init) {
     ble_nus_c_init_t nus_c_init_t;
+    memset(&nus_c_init_t, 0, sizeof(nus_c_init_t));
     nus_c_init_t.evt_handler = ble_nus_c_evt_handler;
-    APP_ERROR_CHECK(ble_nus_c_init(&m_ble_nus_c, &nus_c_init_t));
+#if SDK_VERSION >= 17
+    nus_c_init_t.p_gatt_queue = &m_ble_gatt_queue;
+#endif
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_ble_nus_c); i++) {
+      APP_ERROR_CHECK(ble_nus_c_init(&m_ble_nus_c[i], &nus_c_init_t));
+    }
     nus_init = true;
   }
-  m_is_central = true;
   m_scan_params.timeout = timeout_s * 100;
-  m_scan_params.extended = m_long_range ? 1 : 0;
-  m_scan_params.scan_phys = m_long_range ? BLE_GAP_PHY_CODED : BLE_GAP_PHY_AUTO;
+  scan_params_phys(m_phy_policy.conn_phys, false);
+  // Without address the first device found in the accept list is connected
+  m_scan_params.filter_policy = !addr && m_accept_cnt ? BLE_GAP_SCAN_FP_WHITELIST : BLE_GAP_SCAN_FP_ACCEPT_ALL;
   return sd_ble_gap_connect(addr, &m_scan_params, &m_connection_param, APP_BLE_CONN_CFG_TAG);
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_connect_to(ble_gap_addr_t *addr, db_disc_cb_t disc_cb, nus_c_rx_cb_t nus_c_rx_cb) {
-  return enrf_connect(addr, disc_cb, nus_c_rx_cb, 0);
+ret_code_t enrf_connect_to(ble_gap_addr_t *addr, db_disc_cb_t disc_cb, nus_c_rx_cb_t nus_c_rx_cb) {
+  return enrf_connect(addr, disc_cb, nus_c_rx_cb, 0);
+}
+
+//--------------------------------------------------------------------------
+
+bool enrf_connect_wait(ble_gap_addr_t *addr,
+                       db_disc_cb_t disc_cb,
+                       nus_c_rx_cb_t nus_c_rx_cb,
+                       bool *ready_ind,
+                       uint32_t timeout_s,
+                       uint32_t max_tries,
+                       uint16_t *conn_handle) {
+  *ready_ind = false;
+  uint32_t tries = 0;
+  m_connect_handle = BLE_CONN_HANDLE_INVALID;
+  m_disconnected = true;
+  m_timeout = false;
+  while (!*ready_ind && !m_timeout) {
+    if (m_disconnected) {
+      m_disconnected = false;
+      tries++;
+      if (tries > 1) {
+        sd_ble_gap_connect_cancel();
+      }
+      if ((tries > max_tries) || (enrf_connect(addr, disc_cb, nus_c_rx_cb, timeout_s) != NRF_SUCCESS)) {
+        break;
+      }
+    }
+    enrf_wait_for_event();
+  }
+  if (conn_handle) {
+    *conn_handle = *ready_ind ? m_connect_handle : BLE_CONN_HANDLE_INVALID;
+  }
+  return *ready_ind;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_disconnect(uint16_t conn_handle) {
+  if (conn_handle != BLE_CONN_HANDLE_ALL) {
+    return sd_ble_gap_disconnect(conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+  }
+  ret_code_t err_code = NRF_SUCCESS;
+  for (uint16_t i = 0; i < NRF_SDH_BLE_TOTAL_LINK_COUNT; i++) {
+    if (link_get(i)) {
+      ret_code_t res = sd_ble_gap_disconnect(i, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+      err_code = err_code == NRF_SUCCESS ? res : err_code;
+    }
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+bool enrf_disconnect_wait(uint16_t conn_handle, uint32_t timeout_s) {
+  enrf_disconnect(conn_handle);
+  // Wait for disconnection
+  uint32_t cnt = 0;
+  while (enrf_is_connected(conn_handle) && (cnt++ < timeout_s * 10)) {
+    enrf_delay_ms(100);
+  }
+  return !enrf_is_connected(conn_handle);
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_enable_char_notif(uint16_t conn_handle, uint16_t cccd_handle, bool enable) {
+  uint8_t buf[BLE_CCCD_VALUE_LEN];
+  buf[0] = enable ? BLE_GATT_HVX_NOTIFICATION | BLE_GATT_HVX_INDICATION : 0;
+  buf[1] = 0;
+  const ble_gattc_write_params_t write_params = {
+    .write_op = BLE_GATT_OP_WRITE_REQ,
+    .flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE,
+    .handle = cccd_handle,
+    .offset = 0,
+    .len = sizeof(buf),
+    .p_value = buf
+  };
+  return sd_ble_gattc_write(conn_handle, &write_params);
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_write_char(uint16_t conn_handle, uint8_t op, uint16_t char_handle, uint8_t *data,
+                           uint16_t length) {
+  const ble_gattc_write_params_t write_params = {
+    .write_op = op,
+    .flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE,
+    .handle = char_handle,
+    .offset = 0,
+    .len = length,
+    .p_value = data
+  };
+  return sd_ble_gattc_write(conn_handle, &write_params);
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_read_char(uint16_t conn_handle, uint16_t char_handle) {
+  return sd_ble_gattc_read(conn_handle, char_handle, 0);
+}
+
+//--------------------------------------------------------------------------
+
+static void gatt_req_complete(link_t *p_link, uint16_t char_handle, uint16_t gatt_status,
+                              const uint8_t *data, uint16_t length) {
+  // Responses for requests from other modules using the queue are ignored
+  gatt_req_t req = {0};
+  CRITICAL_REGION_ENTER();
+  if (p_link->gatt_req_cnt && p_link->gatt_reqs[p_link->gatt_req_first].char_handle == char_handle) {
+    req = p_link->gatt_reqs[p_link->gatt_req_first];
+    p_link->gatt_req_first = (p_link->gatt_req_first + 1) % ARRAY_SIZE(p_link->gatt_reqs);
+    p_link->gatt_req_cnt--;
+  }
+  CRITICAL_REGION_EXIT();
+  if (req.cb) {
+    req.cb(p_link->conn_handle, char_handle, gatt_status, data, length, req.p_context);
+  }
+}
+
+#if SDK_VERSION >= 17
+
+//--------------------------------------------------------------------------
+
+static void gatt_req_error_handler(uint32_t nrf_error, void *p_ctx, uint16_t conn_handle) {
+  // The request could not be issued, the character handle is passed as context
+  NRF_LOG_ERROR("GATT request failed: 0x%X", nrf_error);
+  link_t *p_link = link_get(conn_handle);
+  if (p_link) {
+    gatt_req_complete(p_link, (uint16_t)(uintptr_t)p_ctx, BLE_GATT_STATUS_UNKNOWN, NULL, 0);
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t gatt_req_add(uint16_t conn_handle, nrf_ble_gq_req_t *p_req, uint16_t char_handle,
+                               gatt_req_cb_t cb, void *p_context) {
+  link_t *p_link = link_get(conn_handle);
+  if (!p_link) {
+    return NRF_ERROR_INVALID_STATE;
+  }
+  p_req->error_handler.cb = gatt_req_error_handler;
+  p_req->error_handler.p_ctx = (void *)(uintptr_t)char_handle;
+  ret_code_t err_code = NRF_ERROR_NO_MEM;
+  CRITICAL_REGION_ENTER();
+  if (p_link->gatt_req_cnt < ARRAY_SIZE(p_link->gatt_reqs)) {
+    // Register the completion before the request can be issued
+    gatt_req_t *p_pending = &p_link->gatt_reqs[(p_link->gatt_req_first + p_link->gatt_req_cnt) %
+                                                ARRAY_SIZE(p_link->gatt_reqs)];
+    p_pending->cb = cb;
+    p_pending->p_context = p_context;
+    p_pending->char_handle = char_handle;
+    p_link->gatt_req_cnt++;
+    err_code = nrf_ble_gq_item_add(&m_ble_gatt_queue, p_req, conn_handle);
+    if (err_code != NRF_SUCCESS) {
+      p_link->gatt_req_cnt--;
+    }
+  }
+  CRITICAL_REGION_EXIT();
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_gatt_read(uint16_t conn_handle, uint16_t char_handle, gatt_req_cb_t cb,
+                          void *p_context) {
+  nrf_ble_gq_req_t req;
+  memset(&req, 0, sizeof(req));
+  req.type = NRF_BLE_GQ_REQ_GATTC_READ;
+  req.params.gattc_read.handle = char_handle;
+  req.params.gattc_read.offset = 0;
+  return gatt_req_add(conn_handle, &req, char_handle, cb, p_context);
 }
 
 //--------------------------------------------------------------------------
 
-bool enrf_connect_wait(ble_gap_addr_t *addr,
-                       db_disc_cb_t disc_cb,
-                       nus_c_rx_cb_t nus_c_rx_cb,
-                       bool *ready_ind,
-                       uint32_t timeout_s,
-                       uint32_t max_tries) {
-  *ready_ind = false;
-  uint32_t tries = 0;
-  m_disconnected = true;
-  m_timeout = false;
-  while (!*ready_ind && !m_timeout) {
-    if (m_disconnected) {
-      m_disconnected = false;
-      tries++;
-      if (tries > 1) {
-        sd_ble_gap_connect_cancel();
-      }
-      if ((tries > max_tries) || (enrf_connect(addr, disc_cb, nus_c_rx_cb, timeout_s) != NRF_SUCCESS)) {
-        break;
-      }
-    }
-    enrf_wait_for_event();
-  }
-  return *ready_ind;
+ret_code_t enrf_gatt_write(uint16_t conn_handle, uint16_t char_handle, const uint8_t *data,
+                           uint16_t length, gatt_req_cb_t cb, void *p_context) {
+  // The data is copied by the queue
+  nrf_ble_gq_req_t req;
+  memset(&req, 0, sizeof(req));
+  req.type = NRF_BLE_GQ_REQ_GATTC_WRITE;
+  req.params.gattc_write.write_op = BLE_GATT_OP_WRITE_REQ;
+  req.params.gattc_write.flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE;
+  req.params.gattc_write.handle = char_handle;
+  req.params.gattc_write.offset = 0;
+  req.params.gattc_write.len = length;
+  req.params.gattc_write.p_value = data;
+  return gatt_req_add(conn_handle, &req, char_handle, cb, p_context);
 }
 
+#else
+
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_disconnect() {
-  return sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+ret_code_t enrf_gatt_read(uint16_t conn_handle, uint16_t char_handle, gatt_req_cb_t cb,
+                          void *p_context) {
+  return NRF_ERROR_NOT_SUPPORTED;
 }
 
 //--------------------------------------------------------------------------
 
-bool enrf_disconnect_wait(uint32_t timeout_s) {
-  enrf_disconnect();
-  // Wait for disconnection
-  uint32_t cnt = 0;
-  while (enrf_is_connected() && (cnt < timeout_s * 10)) {
-    enrf_delay_ms(100);
-  }
-  return !enrf_is_connected();
+ret_code_t enrf_gatt_write(uint16_t conn_handle, uint16_t char_handle, const uint8_t *data,
+                           uint16_t length, gatt_req_cb_t cb, void *p_context) {
+  return NRF_ERROR_NOT_SUPPORTED;
 }
 
+#endif
+
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_enable_char_notif(uint16_t cccd_handle, bool enable) {
+ret_code_t enrf_gatt_notif_enable(uint16_t conn_handle, uint16_t cccd_handle, bool enable,
+                                  gatt_req_cb_t cb, void *p_context) {
   uint8_t buf[BLE_CCCD_VALUE_LEN];
   buf[0] = enable ? BLE_GATT_HVX_NOTIFICATION | BLE_GATT_HVX_INDICATION : 0;
   buf[1] = 0;
-  const ble_gattc_write_params_t write_params = {
-    .write_op = BLE_GATT_OP_WRITE_REQ,
-    .flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE,
-    .handle = cccd_handle,
-    .offset = 0,
-    .len = sizeof(buf),
-    .p_value = buf
-  };
-  return sd_ble_gattc_write(m_conn_handle, &write_params);
+  return enrf_gatt_write(conn_handle, cccd_handle, buf, sizeof(buf), cb, p_context);
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_write_char(uint8_t op, uint16_t char_handle, uint8_t *data, uint16_t length) {
+static ret_code_t nus_c_send(uint16_t conn_handle, uint8_t *data, uint16_t *length) {
+  // Write without response directly to the softdevice, which copies the data to its own queue
+  uint16_t nus_rx_handle = m_ble_nus_c[conn_handle].handles.nus_rx_handle;
+  if (nus_rx_handle == BLE_GATT_HANDLE_INVALID) {
+    return NRF_ERROR_INVALID_STATE;
+  }
   const ble_gattc_write_params_t write_params = {
-    .write_op = op,
+    .write_op = BLE_GATT_OP_WRITE_CMD,
     .flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE,
-    .handle = char_handle,
+    .handle = nus_rx_handle,
     .offset = 0,
-    .len = length,
+    .len = *length,
     .p_value = data
   };
-  return sd_ble_gattc_write(m_conn_handle, &write_params);
+  return sd_ble_gattc_write(conn_handle, &write_params);
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_set_nus_c_tx_callback(nus_tx_cb_t cb, uint32_t low_watermark) {
+  m_nus_c_tx_notify.cb = cb;
+  m_nus_c_tx_notify.low_watermark = low_watermark;
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_read_char(uint16_t char_handle) {
-  return sd_ble_gattc_read(m_conn_handle, char_handle, 0);
+uint32_t enrf_nus_c_tx_free(uint16_t conn_handle) {
+  link_t *p_link = link_get_role(conn_handle, BLE_GAP_ROLE_CENTRAL);
+  return p_link ? tx_queue_free(&p_link->nus_tx) : 0;
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_nus_c_data_send(const uint8_t *data, uint32_t length) {
-  return ble_nus_c_string_send(&m_ble_nus_c, (uint8_t *)data, length);
+ret_code_t enrf_nus_c_data_send(uint16_t conn_handle, const uint8_t *data, uint32_t length) {
+  return tx_queue_put(link_get_role(conn_handle, BLE_GAP_ROLE_CENTRAL), data, length);
 }
 
 //--------------------------------------------------------------------------
 
-ret_code_t enrf_nus_c_string_send(const char *str) {
-  return enrf_nus_c_data_send((const uint8_t *)str, strlen(str));
+ret_code_t enrf_nus_c_string_send(uint16_t conn_handle, const char *str) {
+  return enrf_nus_c_data_send(conn_handle, (const uint8_t *)str, strlen(str));
 }
 
 //--------------------------------------------------------------------------
@@ -825,9 +2983,7 @@ void enrf_restart(bool enter_dfu) {
     sd_power_gpregret_clr(0, 0xffffffff);
     sd_power_gpregret_set(0, 0xB1);
   }
-  if (m_conn_handle != BLE_CONN_HANDLE_INVALID) {
-    sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-  }
+  enrf_disconnect(BLE_CONN_HANDLE_ALL);
   NRF_LOG_PROCESS();
   nrf_delay_ms(1000);
   NVIC_SystemReset();
@@ -967,14 +3123,42 @@ void bytes_to_hex(uint8_t *bytes, uint32_t len, char *str) {
 
 //--------------------------------------------------------------------------
 
-#if defined(ENRF_SERIAL_USB) || defined(ENRF_SERIAL_UART)
+#if defined(ENRF_SERIAL_USB) || defined(ENRF_SERIAL_UART) || defined(ENRF_SERIAL_UARTE) || \
+    defined(ENRF_SERIAL_RTT)
 
-#define READ_BUFF_SIZE 255
+#ifndef READ_BUFF_SIZE
+// Room for a full 255 byte advertising payload in hex
+#define READ_BUFF_SIZE 600
+#endif
 
-static bool m_input_available = false;
+// Send buffer of the usb, uarte and rtt backends
+#ifndef ENRF_SERIAL_TX_BUFF_SIZE
+#define ENRF_SERIAL_TX_BUFF_SIZE 2048
+#endif
+// Max wait for room to send when writing from thread mode, before the data is dropped
+#define SERIAL_TX_WAIT_MS 100
+static uint32_t m_serial_tx_dropped = 0;
+
+// Received lines are queued in a ring of line records. Written only by the receive handler and
+// released only by the reader, the counters are never modified by both
+#ifndef ENRF_SERIAL_RX_LINES
+#define ENRF_SERIAL_RX_LINES 4
+#endif
+// Keeps the slot mapping continuous when the counters wrap
+STATIC_ASSERT(IS_POWER_OF_TWO(ENRF_SERIAL_RX_LINES), "Serial rx lines must be a power of two");
+typedef struct {
+  size_t len;
+  char   data[READ_BUFF_SIZE + 1];
+} input_line_t;
+static input_line_t m_input_lines[ENRF_SERIAL_RX_LINES];
+static volatile uint32_t m_input_wr = 0;
+static volatile uint32_t m_input_rd = 0;
+// Length of the line being received into the record at m_input_wr
 static size_t m_input_pos = 0;
-static char m_input_buffer[READ_BUFF_SIZE];
+static bool m_input_dropping = false;
+static uint32_t m_input_dropped = 0;
 static serial_read_callback_t m_read_cb = NULL;
+static serial_data_callback_t m_data_cb = NULL;
 
 void enrf_set_serial_read_callback(serial_read_callback_t cb) {
   m_read_cb = cb;
@@ -982,18 +3166,204 @@ void enrf_set_serial_read_callback(serial_read_callback_t cb) {
 
 //--------------------------------------------------------------------------
 
+void enrf_set_serial_data_callback(serial_data_callback_t cb) {
+  m_data_cb = cb;
+}
+
+//--------------------------------------------------------------------------
+
+static void serial_input(const uint8_t *data, size_t len) {
+  // Received data goes to the callbacks when set, otherwise it is collected as a line
+  if (m_data_cb) {
+    m_data_cb(data, len);
+  } else if (m_read_cb) {
+    for (size_t i = 0; i < len; i++) {
+      m_read_cb(data[i]);
+    }
+  } else {
+    for (size_t i = 0; i < len; i++) {
+      if (data[i] == '\r') {
+        continue;
+      }
+      if (m_input_wr - m_input_rd >= ENRF_SERIAL_RX_LINES) {
+        // No free record, skip the rest of the line
+        if (!m_input_dropping) {
+          m_input_dropped++;
+          m_input_dropping = true;
+        }
+        if (data[i] == '\n') {
+          m_input_dropping = false;
+        }
+        continue;
+      }
+      if (m_input_dropping) {
+        // Freed in the middle of a dropped line
+        m_input_dropping = data[i] != '\n';
+        continue;
+      }
+      input_line_t *p_line = &m_input_lines[m_input_wr % ENRF_SERIAL_RX_LINES];
+      p_line->data[m_input_pos++] = data[i];
+      if (data[i] == '\n' || m_input_pos >= READ_BUFF_SIZE) {
+        p_line->data[m_input_pos] = 0;
+        p_line->len = m_input_pos;
+        m_input_pos = 0;
+        // Record complete before it is handed over
+        __DMB();
+        m_input_wr++;
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+
+const char *enrf_serial_peek_line(size_t *p_len) {
+  if (m_input_rd == m_input_wr) {
+    return NULL;
+  }
+  __DMB();
+  input_line_t *p_line = &m_input_lines[m_input_rd % ENRF_SERIAL_RX_LINES];
+  if (p_len) {
+    *p_len = p_line->len;
+  }
+  return p_line->data;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_serial_release_line() {
+  if (m_input_rd != m_input_wr) {
+    // Done with the record before it can be reused
+    __DMB();
+    m_input_rd++;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+uint32_t enrf_serial_rx_dropped() {
+  return m_input_dropped;
+}
+
+//--------------------------------------------------------------------------
+
 size_t enrf_serial_read(char *str, size_t max_length) {
-  if (!m_input_available) {
+  size_t len;
+  const char *p_line = enrf_serial_peek_line(&len);
+  if (!p_line) {
     return 0;
   }
-  size_t len = MIN(max_length - 1, m_input_pos);
-  strncpy(str, m_input_buffer, len);
+  len = MIN(max_length - 1, len);
+  strncpy(str, p_line, len);
   str[len] = 0;
-  m_input_pos = 0;
-  m_input_available = false;
+  enrf_serial_release_line();
   return len;
 }
 
+//--------------------------------------------------------------------------
+
+uint32_t enrf_serial_tx_dropped() {
+  return m_serial_tx_dropped;
+}
+
+#endif
+
+#if defined(ENRF_SERIAL_USB) || defined(ENRF_SERIAL_UARTE)
+
+// Written data is queued in a ring buffer and sent from the transfer done event. All data queued
+// while a transfer is running goes out as the next transfer, for usb split into 64 byte packets
+// by the driver. With more data queued, usb transfers are whole packets and the remainder is
+// sent with the following data
+#ifdef ENRF_SERIAL_UARTE
+// Limited by the EasyDMA counter
+#define SERIAL_TX_MAX_TRANSFER ((1 << UARTE0_EASYDMA_MAXCNT_SIZE) - 1)
+#define SERIAL_TX_PACKET 1
+#else
+#define SERIAL_TX_MAX_TRANSFER ENRF_SERIAL_TX_BUFF_SIZE
+#define SERIAL_TX_PACKET NRF_DRV_USBD_EPSIZE
+#endif
+
+static uint8_t m_serial_tx_buffer[ENRF_SERIAL_TX_BUFF_SIZE];
+static volatile size_t m_serial_tx_rd_pos = 0;
+static volatile size_t m_serial_tx_used = 0;
+// Length of the running transfer, 0 when idle
+static volatile size_t m_serial_tx_len = 0;
+static uint32_t m_serial_tx_start;
+
+// Implemented by the backend
+static ret_code_t serial_tx_transfer(const uint8_t *data, size_t len);
+static bool serial_tx_poll();
+
+static void serial_tx_reset() {
+  CRITICAL_REGION_ENTER();
+  m_serial_tx_rd_pos = 0;
+  m_serial_tx_used = 0;
+  m_serial_tx_len = 0;
+  CRITICAL_REGION_EXIT();
+}
+
+//--------------------------------------------------------------------------
+
+static void serial_tx_start() {
+  // Send everything queued up to the end of the buffer, the rest follows when done
+  const uint8_t *p_data = NULL;
+  size_t len = 0;
+  CRITICAL_REGION_ENTER();
+  if (!m_serial_tx_len && m_serial_tx_used) {
+    len = MIN(m_serial_tx_used, ENRF_SERIAL_TX_BUFF_SIZE - m_serial_tx_rd_pos);
+    len = MIN(len, SERIAL_TX_MAX_TRANSFER);
+    if (len < m_serial_tx_used && len > SERIAL_TX_PACKET) {
+      len -= len % SERIAL_TX_PACKET;
+    }
+    p_data = m_serial_tx_buffer + m_serial_tx_rd_pos;
+    m_serial_tx_len = len;
+    m_serial_tx_start = enrf_millis();
+  }
+  CRITICAL_REGION_EXIT();
+  if (len && serial_tx_transfer(p_data, len) != NRF_SUCCESS) {
+    // Retried on next write
+    m_serial_tx_len = 0;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+static void serial_tx_done() {
+  CRITICAL_REGION_ENTER();
+  m_serial_tx_rd_pos = (m_serial_tx_rd_pos + m_serial_tx_len) % ENRF_SERIAL_TX_BUFF_SIZE;
+  m_serial_tx_used -= m_serial_tx_len;
+  m_serial_tx_len = 0;
+  CRITICAL_REGION_EXIT();
+  serial_tx_start();
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t serial_tx_queue(const uint8_t *data, size_t len) {
+  if (len > ENRF_SERIAL_TX_BUFF_SIZE - m_serial_tx_used &&
+      current_int_priority_get() == APP_IRQ_PRIORITY_THREAD) {
+    // Let queued transfers complete, but not when called from an interrupt
+    uint32_t start = enrf_millis();
+    while (len > ENRF_SERIAL_TX_BUFF_SIZE - m_serial_tx_used &&
+           (enrf_millis() - start) < SERIAL_TX_WAIT_MS && serial_tx_poll());
+  }
+  ret_code_t res = NRF_SUCCESS;
+  CRITICAL_REGION_ENTER();
+  if (len > ENRF_SERIAL_TX_BUFF_SIZE - m_serial_tx_used) {
+    m_serial_tx_dropped += len;
+    res = NRF_ERROR_NO_MEM;
+  } else {
+    size_t wr_pos = (m_serial_tx_rd_pos + m_serial_tx_used) % ENRF_SERIAL_TX_BUFF_SIZE;
+    size_t first = MIN(len, ENRF_SERIAL_TX_BUFF_SIZE - wr_pos);
+    memcpy(m_serial_tx_buffer + wr_pos, data, first);
+    memcpy(m_serial_tx_buffer, data + first, len - first);
+    m_serial_tx_used += len;
+  }
+  CRITICAL_REGION_EXIT();
+  serial_tx_start();
+  return res;
+}
+
 #endif
 
 #ifdef ENRF_SERIAL_USB
@@ -1005,7 +3375,8 @@ size_t enrf_serial_read(char *str, size_t max_length) {
 #define CDC_ACM_DATA_EPIN NRF_DRV_USBD_EPIN1
 #define CDC_ACM_DATA_EPOUT NRF_DRV_USBD_EPOUT1
 
-#define READ_SIZE 1
+// Reads return whatever is available, up to a full bulk packet
+#define READ_SIZE NRF_DRV_USBD_EPSIZE
 
 static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const *p_inst,
                                     app_usbd_cdc_acm_user_event_t event);
@@ -1013,8 +3384,6 @@ static void usbd_user_ev_handler(app_usbd_event_type_t event);
 
 static bool m_acm_connected = false;
 
-static volatile bool m_acm_tx_done = false;
-
 APP_USBD_CDC_ACM_GLOBAL_DEF(m_app_cdc_acm,
                             cdc_acm_user_ev_handler,
                             CDC_ACM_COMM_INTERFACE,
@@ -1033,36 +3402,23 @@ static void cdc_acm_user_ev_handler(app_usbd_class_inst_t const *p_inst,
   switch (event) {
     case APP_USBD_CDC_ACM_USER_EVT_PORT_OPEN: {
       // Setup first transfer
-      app_usbd_cdc_acm_read(&m_app_cdc_acm, rx_buffer, READ_SIZE);
+      app_usbd_cdc_acm_read_any(&m_app_cdc_acm, rx_buffer, READ_SIZE);
       m_acm_connected = true;
       break;
     }
     case APP_USBD_CDC_ACM_USER_EVT_PORT_CLOSE:
       m_acm_connected = false;
+      serial_tx_reset();
       break;
     case APP_USBD_CDC_ACM_USER_EVT_TX_DONE:
-      m_acm_tx_done = true;
+      serial_tx_done();
       break;
-    case APP_USBD_CDC_ACM_USER_EVT_RX_DONE: {
-      if (m_read_cb) {
-        do {
-          m_read_cb(rx_buffer[0]);
-        } while (app_usbd_cdc_acm_read(&m_app_cdc_acm, rx_buffer, READ_SIZE) == NRF_SUCCESS);
-      } else {
-        ret_code_t ret;
-        do {
-          if (!m_input_available && rx_buffer[0] != '\r') {
-            m_input_buffer[m_input_pos++] = rx_buffer[0];
-            if (rx_buffer[0] == '\n' || m_input_pos >= READ_BUFF_SIZE) {
-              m_input_available = true;
-            }
-          }
-          // Fetch data until internal buffer is empty
-          ret = app_usbd_cdc_acm_read(&m_app_cdc_acm, rx_buffer, READ_SIZE);
-        } while (ret == NRF_SUCCESS);
-      }
+    case APP_USBD_CDC_ACM_USER_EVT_RX_DONE:
+      do {
+        serial_input((const uint8_t *)rx_buffer, app_usbd_cdc_acm_rx_size(&m_app_cdc_acm));
+        // Fetch data until internal buffer is empty, then the next read is pending
+      } while (app_usbd_cdc_acm_read_any(&m_app_cdc_acm, rx_buffer, READ_SIZE) == NRF_SUCCESS);
       break;
-    }
     default:
       break;
   }
@@ -1113,28 +3469,34 @@ ret_code_t enrf_serial_enable(bool on) {
 
 //--------------------------------------------------------------------------
 
-#define MILLIS (uint32_t)((uint64_t)NRF_RTC0->COUNTER * 1000 / APP_TIMER_CLOCK_FREQ)
+static ret_code_t serial_tx_transfer(const uint8_t *data, size_t len) {
+  return app_usbd_cdc_acm_write(&m_app_cdc_acm, data, len);
+}
+
+//--------------------------------------------------------------------------
+
+static bool serial_tx_poll() {
+  // Usb events are processed in thread mode
+  app_usbd_event_queue_process();
+  return m_acm_connected;
+}
+
+//--------------------------------------------------------------------------
 
 ret_code_t enrf_serial_write_data(const uint8_t *data, size_t len) {
-  ret_code_t res = NRF_SUCCESS;
-  if (m_serial_active && m_acm_connected) {
-    m_acm_tx_done = false;
-    do {
-      res = app_usbd_cdc_acm_write(&m_app_cdc_acm, data, len);
-      app_usbd_event_queue_process();
-    } while (res == NRF_ERROR_BUSY);
-    uint32_t start = MILLIS;
-    while (!m_acm_tx_done) {
-      app_usbd_event_queue_process();
-      if ((MILLIS - start) > 1000) {
-        // APP_USBD_CDC_ACM_USER_EVT_TX_DONE seems not to be delivered sometimes.
-        // Avoid lockup here
-        break;
-      }
-    }
+  if (!m_serial_active || !m_acm_connected) {
+    return NRF_SUCCESS;
   }
-  return res;
+  if (m_serial_tx_len && (enrf_millis() - m_serial_tx_start) > 1000 &&
+      !nrf_drv_usbd_ep_is_busy(CDC_ACM_DATA_EPIN)) {
+    // APP_USBD_CDC_ACM_USER_EVT_TX_DONE seems not to be delivered sometimes.
+    // Avoid lockup here, but only once the endpoint no longer holds the data.
+    // A host not reading keeps it busy until the port is closed
+    serial_tx_done();
+  }
+  return serial_tx_queue(data, len);
 }
+
 //--------------------------------------------------------------------------
 
 ret_code_t enrf_serial_write(const char *str) {
@@ -1157,12 +3519,7 @@ static void uart_event_handler(app_uart_evt_t *p_event) {
   switch (p_event->evt_type) {
     case APP_UART_DATA_READY:
       app_uart_get(&ch);
-      if (!m_input_available && ch != '\r') {
-        m_input_buffer[m_input_pos++] = ch;
-        if (ch == '\n' || m_input_pos >= READ_BUFF_SIZE) {
-          m_input_available = true;
-        }
-      }
+      serial_input(&ch, 1);
       break;
 
     default:
@@ -1200,19 +3557,219 @@ ret_code_t enrf_serial_enable(bool on) {
 
 //--------------------------------------------------------------------------
 
+ret_code_t enrf_serial_write_data(const uint8_t *data, size_t len) {
+  if (!m_serial_active) {
+    return NRF_SUCCESS;
+  }
+  // Writes may be larger than the fifo, wait for it to drain but not when called
+  // from an interrupt
+  bool wait = current_int_priority_get() == APP_IRQ_PRIORITY_THREAD;
+  for (size_t i = 0; i < len; i++) {
+    ret_code_t err_code = app_uart_put(data[i]);
+    if (err_code == NRF_ERROR_NO_MEM && wait) {
+      uint32_t start = enrf_millis();
+      while (err_code == NRF_ERROR_NO_MEM && (enrf_millis() - start) < SERIAL_TX_WAIT_MS) {
+        err_code = app_uart_put(data[i]);
+      }
+    }
+    if (err_code != NRF_SUCCESS) {
+      // The rest is given up
+      m_serial_tx_dropped += len - i;
+      return err_code;
+    }
+  }
+  return NRF_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+
 ret_code_t enrf_serial_write(const char *str) {
+  return enrf_serial_write_data((const uint8_t *)str, strlen(str));
+}
+
+//--------------------------------------------------------------------------
+
+#elif defined(ENRF_SERIAL_UARTE)
+
+// Reception is double buffered, more buffers allow slower release
+#define UARTE_RX_BUF_SIZE 255
+#define UARTE_RX_BUF_CNT 3
+// Received data is delivered after this idle time on the line
+#define UARTE_RX_TIMEOUT_US 100
+
+#ifndef ENRF_UARTE_HWFC
+#define ENRF_UARTE_HWFC 1
+#endif
+
+// TIMER1 counts received bytes and TIMER2 handles the idle timeout.
+// TIMER0 and RTC0 belong to the softdevice and RTC1 to app_timer
+NRF_LIBUARTE_ASYNC_DEFINE(m_libuarte, 0, 1, NRF_LIBUARTE_PERIPHERAL_NOT_USED, 2,
+                          UARTE_RX_BUF_SIZE, UARTE_RX_BUF_CNT);
+
+static void uarte_event_handler(void *context, nrf_libuarte_async_evt_t *p_evt) {
+  switch (p_evt->type) {
+    case NRF_LIBUARTE_ASYNC_EVT_RX_DATA:
+      serial_input(p_evt->data.rxtx.p_data, p_evt->data.rxtx.length);
+      nrf_libuarte_async_rx_free(&m_libuarte, p_evt->data.rxtx.p_data, p_evt->data.rxtx.length);
+      break;
+    case NRF_LIBUARTE_ASYNC_EVT_TX_DONE:
+      serial_tx_done();
+      break;
+    case NRF_LIBUARTE_ASYNC_EVT_ERROR:
+      NRF_LOG_ERROR("Uarte error: 0x%x", p_evt->data.errorsrc);
+      break;
+    default:
+      break;
+  }
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_serial_enable(bool on) {
   ret_code_t err_code = NRF_SUCCESS;
-  if (m_serial_active) {
-    for (size_t i = 0; i < strlen(str) && err_code == NRF_SUCCESS; i++) {
-      err_code = app_uart_put(str[i]);
+  if (on != m_serial_active) {
+    if (on) {
+      nrf_libuarte_async_config_t config = {
+        .tx_pin = TX_PIN_NUMBER,
+        .rx_pin = RX_PIN_NUMBER,
+        .cts_pin = CTS_PIN_NUMBER,
+        .rts_pin = RTS_PIN_NUMBER,
+        .timeout_us = UARTE_RX_TIMEOUT_US,
+        .hwfc = ENRF_UARTE_HWFC ? NRF_UARTE_HWFC_ENABLED : NRF_UARTE_HWFC_DISABLED,
+        .parity = NRF_UARTE_PARITY_EXCLUDED,
+        .baudrate = UARTE_BAUD_RATE,
+        .int_prio = APP_IRQ_PRIORITY_LOW_MID
+      };
+      serial_tx_reset();
+      err_code = nrf_libuarte_async_init(&m_libuarte, &config, uarte_event_handler, NULL);
+      if (err_code == NRF_SUCCESS) {
+        nrf_libuarte_async_enable(&m_libuarte);
+      }
+    } else {
+      nrf_delay_ms(250);
+      nrf_libuarte_async_uninit(&m_libuarte);
     }
+    m_serial_active = on && err_code == NRF_SUCCESS;
+  }
+  return err_code;
+}
+
+//--------------------------------------------------------------------------
+
+static ret_code_t serial_tx_transfer(const uint8_t *data, size_t len) {
+  return nrf_libuarte_async_tx(&m_libuarte, (uint8_t *)data, len);
+}
+
+//--------------------------------------------------------------------------
+
+static bool serial_tx_poll() {
+  // Transfers complete in interrupt context
+  return true;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_serial_write_data(const uint8_t *data, size_t len) {
+  if (!m_serial_active) {
+    return NRF_SUCCESS;
+  }
+  return serial_tx_queue(data, len);
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_serial_write(const char *str) {
+  return enrf_serial_write_data((const uint8_t *)str, strlen(str));
+}
+
+//--------------------------------------------------------------------------
+
+#elif defined(ENRF_SERIAL_RTT)
+
+// Own channel pair, channel 0 is used by the log
+#ifndef ENRF_RTT_CHANNEL
+#define ENRF_RTT_CHANNEL 1
+#endif
+#define RTT_RX_BUFF_SIZE 256
+// Input is polled by a timer as the host gives no notification
+#ifndef ENRF_RTT_POLL_MS
+#define ENRF_RTT_POLL_MS 10
+#endif
+
+// An RTT buffer holds one byte less than its size, room for a full size write
+static char m_rtt_tx_buffer[ENRF_SERIAL_TX_BUFF_SIZE + 1];
+static char m_rtt_rx_buffer[RTT_RX_BUFF_SIZE];
+APP_TIMER_DEF(m_rtt_poll_timer);
+
+static void rtt_poll(void *p_context) {
+  uint8_t data[64];
+  unsigned len;
+  while ((len = SEGGER_RTT_Read(ENRF_RTT_CHANNEL, data, sizeof(data))) > 0) {
+    serial_input(data, len);
   }
+}
 
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_serial_enable(bool on) {
+  static bool timer_created = false;
+  ret_code_t err_code = NRF_SUCCESS;
+  if (on != m_serial_active) {
+    if (on) {
+      // Nothing is lost when the host is not reading, writes are dropped when full
+      // Fails for a channel beyond the ones configured for RTT
+      if (SEGGER_RTT_ConfigUpBuffer(ENRF_RTT_CHANNEL, "enrf", m_rtt_tx_buffer, sizeof(m_rtt_tx_buffer),
+                                    SEGGER_RTT_MODE_NO_BLOCK_SKIP) < 0 ||
+          SEGGER_RTT_ConfigDownBuffer(ENRF_RTT_CHANNEL, "enrf", m_rtt_rx_buffer,
+                                      sizeof(m_rtt_rx_buffer), SEGGER_RTT_MODE_NO_BLOCK_SKIP) < 0) {
+        return NRF_ERROR_INVALID_PARAM;
+      }
+      if (!timer_created) {
+        err_code = app_timer_create(&m_rtt_poll_timer, APP_TIMER_MODE_REPEATED, rtt_poll);
+        timer_created = err_code == NRF_SUCCESS;
+      }
+      if (err_code == NRF_SUCCESS) {
+        err_code = app_timer_start(m_rtt_poll_timer, APP_TIMER_TICKS(ENRF_RTT_POLL_MS), NULL);
+      }
+    } else {
+      err_code = app_timer_stop(m_rtt_poll_timer);
+    }
+    m_serial_active = on && err_code == NRF_SUCCESS;
+  }
   return err_code;
 }
 
 //--------------------------------------------------------------------------
 
+ret_code_t enrf_serial_write_data(const uint8_t *data, size_t len) {
+  if (!m_serial_active) {
+    return NRF_SUCCESS;
+  }
+  // Written completely or not at all
+  bool written = SEGGER_RTT_Write(ENRF_RTT_CHANNEL, data, len) == len;
+  if (!written && len <= ENRF_SERIAL_TX_BUFF_SIZE &&
+      current_int_priority_get() == APP_IRQ_PRIORITY_THREAD) {
+    // Give the host time to read out, but not when called from an interrupt
+    uint32_t start = enrf_millis();
+    while (!written && (enrf_millis() - start) < SERIAL_TX_WAIT_MS) {
+      written = SEGGER_RTT_Write(ENRF_RTT_CHANNEL, data, len) == len;
+    }
+  }
+  if (!written) {
+    m_serial_tx_dropped += len;
+    return NRF_ERROR_NO_MEM;
+  }
+  return NRF_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+
+ret_code_t enrf_serial_write(const char *str) {
+  return enrf_serial_write_data((const uint8_t *)str, strlen(str));
+}
+
+//--------------------------------------------------------------------------
+
 #else
 
 ret_code_t enrf_serial_enable(bool on) {
@@ -1232,6 +3789,29 @@ size_t enrf_serial_read(char *str, size_t max_length) {
   return 0;
 }
 
+//--------------------------------------------------------------------------
+
+const char *enrf_serial_peek_line(size_t *p_len) {
+  return NULL;
+}
+
+//--------------------------------------------------------------------------
+
+void enrf_serial_release_line() {
+}
+
+//--------------------------------------------------------------------------
+
+uint32_t enrf_serial_rx_dropped() {
+  return 0;
+}
+
+//--------------------------------------------------------------------------
+
+uint32_t enrf_serial_tx_dropped() {
+  return 0;
+}
+
 #endif
 
 static bool delay_timeout = false;
@@ -1293,6 +3873,9 @@ bool enrf_init(const char *dev_name, nrf_sdh_ble_evt_handler_t ble_evt_cb) {
   APP_ERROR_CHECK(err_code);
 #endif
 
+  for (uint16_t i = 0; i < NRF_SDH_BLE_TOTAL_LINK_COUNT; i++) {
+    m_links[i].conn_handle = BLE_CONN_HANDLE_INVALID;
+  }
   power_management_init();
   ble_stack_init();
   gap_params_init();
@@ -1309,6 +3892,9 @@ bool enrf_init(const char *dev_name, nrf_sdh_ble_evt_handler_t ble_evt_cb) {
   err_code = ble_db_discovery_init(db_disc_handler);
 #endif
   APP_ERROR_CHECK(err_code);
+#ifdef ENRF_GATT_CACHE
+  gatt_cache_init();
+#endif
 
   m_app_evt_cb = ble_evt_cb;
 
@@ -39,71 +39,300 @@ extern "C" {
 #endif
 
 // Optional callback definitions
-typedef bool (*nus_rx_cb_t)(uint8_t *data, uint32_t length);
+// Connections are identified by the softdevice connection handle
+typedef bool (*nus_rx_cb_t)(uint16_t conn_handle, uint8_t *data, uint32_t length);
 typedef bool (*scan_report_cb_t)(ble_gap_evt_adv_report_t *);
 typedef void (*db_disc_cb_t)(ble_db_discovery_evt_t *p_evt);
-typedef void (*nus_c_rx_cb_t)(uint8_t *data, uint32_t length);
+typedef void (*nus_c_rx_cb_t)(uint16_t conn_handle, uint8_t *data, uint32_t length);
 typedef void (*serial_read_callback_t)(uint8_t b);
+typedef void (*serial_data_callback_t)(const uint8_t *data, size_t len);
+typedef void (*nus_tx_cb_t)(uint16_t conn_handle, uint32_t queued);
+// Completion of a queued GATT client request. Data is the read value, or NULL on failure
+typedef void (*gatt_req_cb_t)(uint16_t conn_handle, uint16_t char_handle, uint16_t gatt_status,
+                              const uint8_t *data, uint16_t length, void *p_context);
+
+// L2CAP channel events, param is the peer SDU size for CONNECTED, the status for REFUSED
+// and the number of SDUs still queued for TX_DONE
+typedef enum {
+  ENRF_L2CAP_EVT_CONNECTED,
+  ENRF_L2CAP_EVT_REFUSED,
+  ENRF_L2CAP_EVT_RELEASED,
+  ENRF_L2CAP_EVT_TX_DONE
+} enrf_l2cap_evt_t;
+typedef void (*l2cap_evt_cb_t)(uint16_t conn_handle, uint16_t local_cid, enrf_l2cap_evt_t evt,
+                               uint16_t param);
+// Complete SDU received on a channel, the buffer must be given back via enrf_l2cap_rx_release
+typedef void (*l2cap_rx_cb_t)(uint16_t conn_handle, uint16_t local_cid, uint8_t *data,
+                              uint16_t length);
+
+// Link settings affecting the throughput of a connection
+typedef struct {
+  uint16_t event_length;          // Connection event length in 1.25 ms units
+  uint8_t  hvn_queue_size;        // Notifications queued in the softdevice per link
+  uint8_t  write_cmd_queue_size;  // Write without response queued in the softdevice per link
+  bool     conn_evt_ext;          // Extend connection events while there is data to transfer
+} enrf_link_config_t;
+
+// Service discovery state of a central link
+typedef enum {
+  ENRF_DISC_IDLE,
+  ENRF_DISC_RUNNING,
+  ENRF_DISC_DONE
+} enrf_disc_state_t;
+
+// Properties of a connection
+typedef struct {
+  uint16_t att_mtu;        // Effective ATT MTU
+  uint16_t max_tx_octets;  // Data length, link layer payload
+  uint16_t max_rx_octets;
+  uint8_t  tx_phy;         // BLE_GAP_PHY_*
+  uint8_t  rx_phy;
+  uint8_t  role;           // BLE_GAP_ROLE_*
+  ble_gap_conn_params_t conn_params;  // Current parameters, min and max interval are equal
+  ble_gap_addr_t peer_addr;
+  uint8_t  disc_state;     // enrf_disc_state_t
+  uint16_t nus_rx_handle;  // NUS client handles, BLE_GATT_HANDLE_INVALID until discovered
+  uint16_t nus_tx_handle;
+} enrf_link_info_t;
+
+// Signal strength of a scanned device, aggregated over the reports since the previous delivered one
+typedef struct {
+  int8_t   rssi_avg;
+  int8_t   rssi_min;
+  int8_t   rssi_max;
+  uint16_t count;     // Number of received reports
+} enrf_scan_stats_t;
+
+// Extended advertising data received in several parts, reassembled before delivery
+typedef struct {
+  uint32_t complete;   // Chains delivered complete
+  uint32_t truncated;  // Delivered with data missing, by the advertiser or lack of buffer space
+  uint32_t dropped;    // Discarded when more chains were in progress than buffers available
+} enrf_adv_chain_stats_t;
+
+// Index of the AD structures in advertising data, built in one pass
+#define ENRF_ADV_INDEX_MAX 16
+typedef struct {
+  const uint8_t *p_data;  // The indexed report data
+  uint8_t count;
+  struct {
+    uint8_t  type;        // BLE_GAP_AD_TYPE_*
+    uint8_t  len;         // Length of the field data, excluding type
+    uint16_t offset;      // Position of the field data
+  } fields[ENRF_ADV_INDEX_MAX];
+} enrf_adv_index_t;
+
+// Predefined connection parameter profiles
+typedef enum {
+  ENRF_CONN_PROFILE_DEFAULT,      // 20-75 ms interval
+  ENRF_CONN_PROFILE_LOW_LATENCY,  // 7.5 ms interval
+  ENRF_CONN_PROFILE_THROUGHPUT,   // 30-50 ms interval, long connection events
+  ENRF_CONN_PROFILE_LOW_POWER     // 100-200 ms interval, slave latency 4
+} enrf_conn_profile_t;
 
 // Initiate the BLE stack
 bool enrf_init(const char *dev_name, nrf_sdh_ble_evt_handler_t ble_evt_cb);
+// Override the link settings given via make variables. Must be called before enrf_init
+void enrf_set_link_config(const enrf_link_config_t *config);
+
+// PHY preferences for the different roles, BLE_GAP_PHY_* values
+typedef struct {
+  uint8_t adv_primary_phy;    // 1M or coded
+  uint8_t adv_secondary_phy;  // 1M, 2M or coded. Other than 1M gives extended advertising
+  bool    adv_extended;       // Extended advertising also on 1M. Used anyway for data over 31 bytes
+  uint8_t scan_phys;          // 1M and/or coded, both are scanned in the same session
+  bool    scan_extended;      // Receive extended advertising, always used with coded
+  uint8_t conn_phys;          // Initiating PHYs when connecting, 1M and/or coded
+  uint8_t periph_link_phys;   // PHYs requested after connect as peripheral, AUTO for no request
+  uint8_t central_link_phys;  // Same for central connections
+} enrf_phy_policy_t;
 
 // Set PHY and tx power for all subsequent operations
+// Coded PHY is always transmitted with S8 coding by the softdevice
+void enrf_set_phy_policy(const enrf_phy_policy_t *policy);
+void enrf_get_phy_policy(enrf_phy_policy_t *policy);
+// Shorthand for selecting coded or 1M PHY for advertising, scanning and connect
 void enrf_set_phy(bool long_range);
 void enrf_set_tx_power(int tx_power);
 
 //== Peripheral role functions ==
 
+// Advertising interval phases. A fast phase is followed by the slow interval given when
+// starting, the timeout given then covers both phases
+typedef struct {
+  uint32_t fast_interval_ms;  // 0 disables the fast phase
+  uint32_t fast_duration_s;
+  bool     directed_reconnect;// High duty directed advertising to the last central after a
+                              // disconnect not made locally. Legacy connectable only
+} enrf_adv_policy_t;
+// Applies when advertising is started or resumed
+void enrf_set_adv_policy(const enrf_adv_policy_t *policy);
+void enrf_get_adv_policy(enrf_adv_policy_t *policy);
+// Advertising is resumed after a connection while more peripheral links are available and
+// after a disconnect, starting over with the first phase
 ret_code_t enrf_start_advertise(bool connectable,
                                 uint16_t company_id, ble_advdata_name_type_t type,
                                 uint8_t *p_data, uint8_t size,
                                 uint32_t interval_ms, uint32_t timeout_s,
                                 nus_rx_cb_t nus_cb);
 ret_code_t enrf_stop_advertise();
+// Advertising started and not stopped or timed out. Stays true between the phases and while
+// paused by connections. Updated before the application gets BLE_GAP_EVT_ADV_SET_TERMINATED
+bool enrf_is_advertising();
+// Set scan response data for active scanners, NULL clears. Applies to legacy advertising, as
+// extended advertising carries up to 255 bytes in the advertising data itself. Updated in
+// place when advertising
+ret_code_t enrf_set_scan_response(const ble_advdata_t *p_srdata);
+// Replace the manufacturer data while advertising continues, other settings are kept
+// The data is encoded into a second buffer and handed over to the softdevice, so the buffer
+// being advertised is never modified
+ret_code_t enrf_update_advertise_data(uint8_t *p_data, uint8_t size);
+// Rotate between several payloads, e.g. a beacon, the name and telemetry, in the running
+// advertising set. Each payload is encoded when added and is kept on air for weight periods
+// at a time. Rotation runs until stopped, clear also frees the slots. It is also stopped, with
+// the slots kept, when advertising stops or times out. The number of slots is given by
+// ENRF_ADV_ROTATION_SLOTS
+ret_code_t enrf_adv_rotation_add(const ble_advdata_t *p_advdata, uint8_t weight, uint8_t *p_slot);
+ret_code_t enrf_adv_rotation_start(uint32_t period_ms);
+void enrf_adv_rotation_stop(bool clear);
 
-// Send data from NUS server
-ret_code_t enrf_nus_data_send(const uint8_t *data, uint32_t length);
-ret_code_t enrf_nus_string_send(const char *str);
+// Send data from NUS server to the central of the specified link
+// Data is queued and sent as notifications in the background. NRF_ERROR_NO_MEM is
+// returned when there is no room for the complete data in the queue of the link
+ret_code_t enrf_nus_data_send(uint16_t conn_handle, const uint8_t *data, uint32_t length);
+ret_code_t enrf_nus_string_send(uint16_t conn_handle, const char *str);
+// Number of bytes currently available in the NUS send queue of the link
+uint32_t enrf_nus_tx_free(uint16_t conn_handle);
+// Callback when the send queue of a link has been drained to or below the specified level.
+// A low_watermark of 0 gives a callback when all queued data has been sent
+void enrf_set_nus_tx_callback(nus_tx_cb_t cb, uint32_t low_watermark);
 
 //== Central role functions ==
 
 // Scan for peripheral devices
+// Interval and window in 0.625 ms units. When scanning on both 1M and coded PHY, the softdevice
+// uses the window on each PHY within the same interval, so the window is limited to half the
+// interval. The PHY of a report is given by its primary_phy field
 void enrf_set_scan_par(uint16_t scan_int, uint16_t scan_wind);
 ret_code_t enrf_start_scan(scan_report_cb_t report_cb, uint32_t timeout_s, bool active);
 ret_code_t enrf_stop_scan();
+// Install up to BLE_GAP_WHITELIST_ADDR_MAX_COUNT peers in the softdevice accept list, a count of 0
+// clears it. Devices are then filtered by the link layer, when scanning if filter_scan is set and
+// when connecting without address. Not possible while scanning or connecting
+ret_code_t enrf_set_accept_list(const ble_gap_addr_t *addrs, uint8_t count, bool filter_scan);
+// Extended advertising data is delivered complete, up to 1650 bytes, in one report. Partial data
+// is delivered with status BLE_GAP_ADV_DATA_STATUS_INCOMPLETE_TRUNCATED. Parallel chains are
+// limited by make variable ADV_CHAIN_BUFS
+void enrf_get_adv_chain_stats(enrf_adv_chain_stats_t *stats);
+// Deduplicate scan reports before they reach the report callback. A device is reported when its
+// advertising or scan response data changes, otherwise at most every report_interval_ms or never
+// when 0. The rssi of a delivered report is the average since the previous one.
+// The number of tracked devices is set via make variable SCAN_DEDUP_SIZE, the least recently
+// seen ones are replaced
+void enrf_set_scan_dedup(bool enable, uint32_t report_interval_ms);
+// Aggregated rssi of the report being delivered, to be called from the report callback
+void enrf_get_scan_stats(enrf_scan_stats_t *stats);
 // Get the data of the first one of the specified fields in an advertisement package
 uint8_t enrf_adv_parse(ble_gap_evt_adv_report_t *p_adv_report, uint8_t start_tag, uint8_t end_tag,
                        uint8_t *dest, uint8_t dest_len);
+// Index all fields of a report at once, for several lookups. Malformed data ends the index.
+// The number of fields is returned
+uint8_t enrf_adv_index(const ble_gap_evt_adv_report_t *p_adv_report, enrf_adv_index_t *index);
+// Get the first one of the specified fields from an index. Points into the report data, which is
+// only valid in the scan report callback. NULL if not found
+const uint8_t *enrf_adv_index_find(const enrf_adv_index_t *index, uint8_t start_tag, uint8_t end_tag,
+                                   uint8_t *len);
 
-// Set parameters for next connection
+// Set connection parameters. Applied to the current connections immediately and to all
+// subsequent ones, in both roles. Requests from peripherals are limited to this range
 void enrf_set_connection_params(float min_con_int_ms, float max_con_int_ms, uint16_t slave_latency,
                                 float sup_timeout_ms);
+// Select a connection parameter profile. Applied to the current connections immediately and to
+// all subsequent ones, in both roles. Obtained parameters are available via enrf_get_link_info
+ret_code_t enrf_set_conn_profile(enrf_conn_profile_t profile);
 // Add uuid for discovery on connect
 ret_code_t enrf_add_uuid(const char *uuid);
 // Connect and optionally initiate as a Nordic UART client
+// A NULL address connects to the first advertising device in the accept list
+// Several links can be up at the same time, but only one connection can be initiated at a time.
+// The callbacks are kept by the link and the handle is given in the BLE_GAP_EVT_CONNECTED event
 ret_code_t enrf_connect_to(ble_gap_addr_t *addr, db_disc_cb_t disc_cb, nus_c_rx_cb_t nus_c_rx_cb);
 // Same as above but waits for a variable to be set or timeout. Also handle possible initial
-// disconnection and retries connect
+// disconnection and retries connect. The handle of the new link is returned in conn_handle
+// unless NULL
 bool enrf_connect_wait(ble_gap_addr_t *addr,
                        db_disc_cb_t disc_cb,
                        nus_c_rx_cb_t nus_c_rx_cb,
                        bool *ready_ind,
                        uint32_t timeout_s,
-                       uint32_t max_tries);
-bool enrf_is_connected();
-ret_code_t enrf_disconnect();
-bool enrf_disconnect_wait(uint32_t timeout_s);
+                       uint32_t max_tries,
+                       uint16_t *conn_handle);
+
+//== Connection functions, for both roles ==
+
+// Check if the link is connected, BLE_CONN_HANDLE_ALL checks for any link
+bool enrf_is_connected(uint16_t conn_handle);
+// Get the handles of all current links. The total count is returned, max_count are stored
+uint8_t enrf_get_conn_handles(uint16_t *conn_handles, uint8_t max_count);
+// Get role, peer, negotiated MTU, data length, PHY and discovery state of a connection
+ret_code_t enrf_get_link_info(uint16_t conn_handle, enrf_link_info_t *info);
+// Request a PHY change (BLE_GAP_PHY_* values) on a connection. Deferred until the data length
+// or MTU exchange has completed when another procedure is ongoing
+ret_code_t enrf_phy_update(uint16_t conn_handle, uint8_t phys);
+// Disconnect a link, BLE_CONN_HANDLE_ALL disconnects all
+ret_code_t enrf_disconnect(uint16_t conn_handle);
+bool enrf_disconnect_wait(uint16_t conn_handle, uint32_t timeout_s);
 
 // Enable notifications on the specified characteristics cccd handle
-ret_code_t enrf_enable_char_notif(uint16_t cccd_handle, bool enable);
+ret_code_t enrf_enable_char_notif(uint16_t conn_handle, uint16_t cccd_handle, bool enable);
 // Write characteristics data using the specified write-op
-ret_code_t enrf_write_char(uint8_t op, uint16_t char_handle, uint8_t *data, uint16_t length);
+ret_code_t enrf_write_char(uint16_t conn_handle, uint8_t op, uint16_t char_handle, uint8_t *data,
+                           uint16_t length);
 // Read characteristics data
-ret_code_t enrf_read_char(uint16_t char_handle);
+ret_code_t enrf_read_char(uint16_t conn_handle, uint16_t char_handle);
+
+// Queued GATT client requests, completed via callback with the given context.
+// Requests to the same link are performed in order, different links are served in parallel.
+// NRF_ERROR_NO_MEM is returned when the queue of the link is full, size set by make variable
+// BLE_GQ_QUEUE_SIZE. Requires SDK 17 or later, otherwise NRF_ERROR_NOT_SUPPORTED is returned
+ret_code_t enrf_gatt_read(uint16_t conn_handle, uint16_t char_handle, gatt_req_cb_t cb,
+                          void *p_context);
+ret_code_t enrf_gatt_write(uint16_t conn_handle, uint16_t char_handle, const uint8_t *data,
+                           uint16_t length, gatt_req_cb_t cb, void *p_context);
+ret_code_t enrf_gatt_notif_enable(uint16_t conn_handle, uint16_t cccd_handle, bool enable,
+                                  gatt_req_cb_t cb, void *p_context);
+
+// Discovered services are cached in flash per peer when enabled via make variable GATT_CACHE.
+// On reconnect the cache is validated by the peer database hash, or by Service Changed
+// indications for peers without one, and delivered as discovery events without discovery
+ret_code_t enrf_gatt_cache_clear();
+
+// L2CAP connection oriented channels for bulk data. The number of channels per link and the
+// max SDU size are set via make variables L2CAP_CHANNELS and L2CAP_MTU, NRF_ERROR_NOT_SUPPORTED
+// is returned when there are none.
+// Incoming channels are accepted on the registered PSM, 0 refuses all. The callbacks are used
+// for the channels in both directions
+void enrf_l2cap_register(uint16_t psm, l2cap_rx_cb_t rx_cb, l2cap_evt_cb_t evt_cb);
+// Request a channel, ENRF_L2CAP_EVT_CONNECTED or REFUSED follows
+ret_code_t enrf_l2cap_open(uint16_t conn_handle, uint16_t psm, uint16_t *p_local_cid);
+ret_code_t enrf_l2cap_close(uint16_t conn_handle, uint16_t local_cid);
+// Send one SDU, up to the size accepted by the peer. The data is copied and NRF_ERROR_RESOURCES
+// is returned when all transmit buffers are in use, wait for ENRF_L2CAP_EVT_TX_DONE
+ret_code_t enrf_l2cap_send(uint16_t conn_handle, uint16_t local_cid, const uint8_t *data,
+                           uint16_t length);
+// Number of SDUs that can be sent right now
+uint8_t enrf_l2cap_tx_free(uint16_t conn_handle, uint16_t local_cid);
+// Return a received buffer. The peer only gets credits while there are buffers available,
+// so holding on to them throttles the sender
+ret_code_t enrf_l2cap_rx_release(uint16_t conn_handle, uint16_t local_cid, uint8_t *data);
 
-// Send data from the NUS client
-ret_code_t enrf_nus_c_data_send(const uint8_t *data, uint32_t length);
-ret_code_t enrf_nus_c_string_send(const char *str);
+// Send data from the NUS client to the peripheral of the specified link
+// Data is queued, split to the negotiated MTU and sent as write without response.
+// Works the same way as the corresponding NUS server functions
+ret_code_t enrf_nus_c_data_send(uint16_t conn_handle, const uint8_t *data, uint32_t length);
+ret_code_t enrf_nus_c_string_send(uint16_t conn_handle, const char *str);
+uint32_t enrf_nus_c_tx_free(uint16_t conn_handle);
+void enrf_set_nus_c_tx_callback(nus_tx_cb_t cb, uint32_t low_watermark);
 
 //== Utility functions ==
 
@@ -121,13 +350,23 @@ bool enrf_str_to_addr(const char *addr_str, ble_gap_addr_t *gap_addr);
 // Get the mac address of the current device as a string
 const char *enrf_get_device_address();
 
-// Serial string I/O to uart or usb. Activated via make variable ENRF_SERIAL
+// Serial string I/O to uart, uarte, usb or rtt. Activated via make variable ENRF_SERIAL
 ret_code_t enrf_serial_enable(bool on);
 ret_code_t enrf_serial_write(const char *str);
 ret_code_t enrf_serial_write_data(const uint8_t *data, size_t len);
 void enrf_set_serial_read_callback(serial_read_callback_t cb);
+// Received data in blocks as they arrive, up to a usb packet. Used before the byte callback
+void enrf_set_serial_data_callback(serial_data_callback_t cb);
+// Received lines are queued, ENRF_SERIAL_RX_LINES deep. Lines arriving when it is full are dropped
 size_t enrf_serial_read(char *str, size_t max_length);
+// Access the oldest queued line in place, NULL when none. Kept until released
+const char *enrf_serial_peek_line(size_t *p_len);
+void enrf_serial_release_line();
+// Number of lines dropped since start
+uint32_t enrf_serial_rx_dropped();
 bool enrf_acm_connected();
+// Bytes dropped by the serial when it could not be sent in time, always 0 without serial
+uint32_t enrf_serial_tx_dropped();
 
 // Utility functions
 
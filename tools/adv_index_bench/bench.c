@@ -0,0 +1,118 @@
+//====================================================================================
+//
+// bench.c
+//
+// Timing of advertising report lookups, one pass index versus repeated parsing
+//
+// This file is part of easy_nrf52
+// License: LGPL 2.1
+// General and full license information is available at:
+//   https://github.com/plerup/easy_nrf52
+//
+// Copyright (c) 2026 Peter Lerup. All rights reserved.
+//
+//====================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "host.h"
+
+#define ITERATIONS 2000000
+
+// Typical legacy report: flags, 128 bit uuid, tx power and name
+static uint8_t m_legacy[] = {
+  0x02, 0x01, 0x06,
+  0x11, 0x07, 0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5,
+  0x01, 0x00, 0x40, 0x6E,
+  0x02, 0x0A, 0x00,
+  0x06, 0x09, 'e', 'n', 'r', 'f', '1'
+};
+// Extended report filled with manufacturer data fields, the name last
+static uint8_t m_extended[255];
+
+// Lookups done per report, as by a scanning application
+static const uint8_t m_lookups[][2] = {
+  {0x09, 0x09},  // Complete local name
+  {0x06, 0x07},  // 128 bit uuids
+  {0x0A, 0x0A},  // Tx power
+  {0xFF, 0xFF},  // Manufacturer data
+};
+#define LOOKUPS (sizeof(m_lookups) / sizeof(m_lookups[0]))
+
+static volatile uint32_t m_sink;
+
+//--------------------------------------------------------------------------
+
+static void extended_init(void) {
+  uint16_t pos = 0;
+  while (pos + 16 + 8 <= sizeof(m_extended)) {
+    m_extended[pos++] = 15;
+    m_extended[pos++] = 0xFF;
+    for (uint8_t i = 0; i < 14; i++) {
+      m_extended[pos++] = i;
+    }
+  }
+  memcpy(&m_extended[pos], "\x06\x09" "enrf1", 7);
+  pos += 7;
+  memset(&m_extended[pos], 0, sizeof(m_extended) - pos);
+}
+
+//--------------------------------------------------------------------------
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//--------------------------------------------------------------------------
+
+static double bench_parse(ble_gap_evt_adv_report_t *p_report) {
+  uint8_t dest[255];
+  double start = now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    for (uint8_t i = 0; i < LOOKUPS; i++) {
+      m_sink += enrf_adv_parse(p_report, m_lookups[i][0], m_lookups[i][1], dest, sizeof(dest));
+    }
+  }
+  return (now_ns() - start) / ITERATIONS;
+}
+
+//--------------------------------------------------------------------------
+
+static double bench_index(ble_gap_evt_adv_report_t *p_report) {
+  enrf_adv_index_t index;
+  uint8_t len;
+  double start = now_ns();
+  for (uint32_t n = 0; n < ITERATIONS; n++) {
+    enrf_adv_index(p_report, &index);
+    for (uint8_t i = 0; i < LOOKUPS; i++) {
+      if (enrf_adv_index_find(&index, m_lookups[i][0], m_lookups[i][1], &len)) {
+        m_sink += len;
+      }
+    }
+  }
+  return (now_ns() - start) / ITERATIONS;
+}
+
+//--------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  extended_init();
+  struct {
+    const char *name;
+    ble_gap_evt_adv_report_t report;
+  } reports[] = {
+    {"legacy", {{m_legacy, sizeof(m_legacy)}}},
+    {"extended", {{m_extended, sizeof(m_extended)}}},
+  };
+  printf("%-10s %12s %12s   (ns per report, %u lookups)\n", "report", "parse", "index",
+         (unsigned)LOOKUPS);
+  for (uint8_t i = 0; i < sizeof(reports) / sizeof(reports[0]); i++) {
+    double parse_ns = bench_parse(&reports[i].report);
+    double index_ns = bench_index(&reports[i].report);
+    printf("%-10s %12.1f %12.1f\n", reports[i].name, parse_ns, index_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,35 @@
+#!/usr/bin/env perl
+#====================================================================================
+# Extract the advertising data parsing from the library for host builds
+#
+# This file is part of easy_nrf52
+# License: LGPL 2.1
+# General and full license information is available at:
+#    https://github.com/plerup/easy_nrf52
+#
+# Copyright (c) 2026 Peter Lerup. All rights reserved.
+#
+#====================================================================================
+
+use strict;
+
+my ($header, $source) = @ARGV;
+print "// Generated from $header and $source, do not edit\n";
+
+open(my $f, $header) || die "Failed to open $header\n";
+my $copy = 0;
+while (<$f>) {
+  $copy = 1 if /^#define ENRF_ADV_INDEX_MAX/;
+  print if $copy;
+  $copy = 0 if /^} enrf_adv_index_t;/;
+}
+close($f);
+
+open($f, $source) || die "Failed to open $source\n";
+$copy = 0;
+while (<$f>) {
+  $copy = 1 if /^(static bool adv_next_field|uint8_t enrf_adv_parse|uint8_t enrf_adv_index|const uint8_t \*enrf_adv_index_find)\(/;
+  print if $copy;
+  $copy = 0 if /^}/;
+}
+close($f);
@@ -0,0 +1,85 @@
+//====================================================================================
+//
+// fuzz.c
+//
+// Fuzz target for the advertising data parsing. Built for libFuzzer with clang, or
+// with a random input driver of its own otherwise
+//
+// This file is part of easy_nrf52
+// License: LGPL 2.1
+// General and full license information is available at:
+//   https://github.com/plerup/easy_nrf52
+//
+// Copyright (c) 2026 Peter Lerup. All rights reserved.
+//
+//====================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Failed: %s\n", #cond); abort(); }
+
+//--------------------------------------------------------------------------
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size > 255) {
+    // Max advertising data length
+    return 0;
+  }
+  // Own copy to have the sanitizer catch reads beyond the data
+  uint8_t *copy = malloc(size ? size : 1);
+  memcpy(copy, data, size);
+  ble_gap_evt_adv_report_t report = {{copy, size}};
+
+  enrf_adv_index_t index;
+  uint8_t count = enrf_adv_index(&report, &index);
+  CHECK(count == index.count && count <= ENRF_ADV_INDEX_MAX);
+  uint16_t end = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    // Fields follow each other and are completely within the data
+    CHECK(index.fields[i].offset == end + 2);
+    CHECK(index.fields[i].type == copy[end + 1]);
+    end = index.fields[i].offset + index.fields[i].len;
+    CHECK(end <= size);
+  }
+  for (uint16_t type = 0; type <= 0xFF; type++) {
+    // Both lookups give the same first field
+    uint8_t len;
+    uint8_t dest[255];
+    const uint8_t *p_field = enrf_adv_index_find(&index, type, type, &len);
+    uint8_t parse_len = enrf_adv_parse(&report, type, type, dest, sizeof(dest));
+    if (p_field) {
+      CHECK(p_field >= copy && p_field + len <= copy + size);
+      if (count < ENRF_ADV_INDEX_MAX) {
+        CHECK(parse_len == len && memcmp(dest, p_field, len) == 0);
+      }
+    } else if (count < ENRF_ADV_INDEX_MAX) {
+      CHECK(parse_len == 0);
+    }
+  }
+  free(copy);
+  return 0;
+}
+
+//--------------------------------------------------------------------------
+
+#ifdef RANDOM_DRIVER
+
+int main(int argc, char *argv[]) {
+  uint32_t runs = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+  uint8_t data[255];
+  srand(argc > 2 ? strtoul(argv[2], NULL, 0) : 1);
+  for (uint32_t n = 0; n < runs; n++) {
+    size_t size = rand() % (sizeof(data) + 1);
+    for (size_t i = 0; i < size; i++) {
+      // Mostly short lengths, to get many well formed fields
+      data[i] = rand() % 4 ? rand() % 32 : rand();
+    }
+    LLVMFuzzerTestOneInput(data, size);
+  }
+  printf("%u random inputs passed\n", runs);
+  return 0;
+}
+
+#endif
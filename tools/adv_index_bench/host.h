@@ -0,0 +1,35 @@
+//====================================================================================
+//
+// host.h
+//
+// Host stand-ins for the SoftDevice types used by the advertising data parsing,
+// which is taken unchanged from the library
+//
+// This file is part of easy_nrf52
+// License: LGPL 2.1
+// General and full license information is available at:
+//   https://github.com/plerup/easy_nrf52
+//
+// Copyright (c) 2026 Peter Lerup. All rights reserved.
+//
+//====================================================================================
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+  uint8_t *p_data;
+  uint16_t len;
+} ble_data_t;
+
+typedef struct {
+  ble_data_t data;
+} ble_gap_evt_adv_report_t;
+
+#include "adv_fields.inc"
+
+#endif
@@ -13,7 +13,8 @@
 #
 #====================================================================================
 
-import sys, time
+import sys, time, struct
+from functools import reduce
 
 from serial import Serial, SerialException
 from serial.tools import list_ports
@@ -34,7 +35,7 @@ def read_string():
     global connecting, connected
     start = time.time()
     try:
-        resp = uart.readline().decode().strip()
+        resp = uart.readline().decode(errors='replace').strip()
     except Exception as e:
         raise SerialException
 
@@ -57,6 +58,50 @@ def read_string():
 
 #--------------------------------------------------------------------
 
+def read_scan_batch():
+    # Read the next binary scan report frame, see the ble_tool command scan_bin
+    # Text lines in between frames are skipped
+    # Returns sequence no, dropped reports and a list of reports as
+    # (time_ms, address, phy, rssi, data)
+    while True:
+        b = uart.read(1)
+        if not b:
+            raise EOFError
+        if b != b'\xa5' or uart.read(1) != b'\x5a':
+            continue
+        header = uart.read(7)
+        if len(header) != 7:
+            continue
+        length, seq, dropped, count = struct.unpack('<HHHB', header)
+        payload = uart.read(length + 1)
+        if len(payload) != length + 1 or reduce(lambda a, b: a ^ b, payload[:-1], 0) != payload[-1]:
+            err_mess("Invalid scan frame")
+            continue
+        reports = []
+        pos = 0
+        for i in range(count):
+            time_ms, addr_type, addr, phys, rssi, data_len = struct.unpack_from('<IB6sBbH', payload, pos)
+            pos += 15
+            addr_str = ':'.join(f"{a:02X}" for a in reversed(addr))
+            reports.append((time_ms, addr_str, phys & 0xF, rssi, payload[pos:pos + data_len]))
+            pos += data_len
+        if args.debug:
+            print(f"Batch: {seq} reports: {count} dropped: {dropped}")
+        return seq, dropped, reports
+
+#--------------------------------------------------------------------
+
+def adv_fields(data):
+    # Split advertising data into a dictionary of AD type and value
+    fields = dict()
+    pos = 0
+    while pos + 1 < len(data) and data[pos] and pos + 1 + data[pos] <= len(data):
+        fields.setdefault(data[pos + 1], data[pos + 2:pos + 1 + data[pos]])
+        pos += 1 + data[pos]
+    return fields
+
+#--------------------------------------------------------------------
+
 def in_waiting():
     try:
         return uart.in_waiting
@@ -109,6 +154,7 @@ def init(parser):
         uart = Serial(port=args.port, baudrate=115200, timeout=3)
         send_string("disconnect", ignore_err=True)
         send_string("scan;", ignore_err=True)
+        send_string("scan_bin", ignore_err=True)
         send_string('vers')
         send_string(f"led;{indicator_led};1")
         ok = True
@@ -11,6 +11,7 @@
 #
 #====================================================================================
 
+import sys
 from time import sleep
 from pynrfjprog import LowLevel
 from re import match
@@ -18,7 +19,7 @@ from argparse import ArgumentParser
 
 JLINK_SPEED_KHZ = 50000
 READ_SIZE = 1024
-COM_CHANNEL_ID = 0
+LOG_CHANNEL_ID = 0
 
 RED     = "\033[1;31m"
 GREEN   = "\033[1;32m"
@@ -26,8 +27,10 @@ ORANGE  = "\033[1;33m"
 BLUE    = "\033[1;34m"
 END_COL = "\033[0m"
 
+log_out = sys.stdout
+
 def read_callback(channel_index, data, _):
-    data = data.decode()
+    data = data.decode(errors="replace")
     for line in data.splitlines():
         if line:
             col = GREEN
@@ -39,9 +42,21 @@ def read_callback(channel_index, data, _):
                     col = ORANGE
                 elif "debug" in m.group(1):
                     col = BLUE
-                print(m.group(1) + col + m.group(2) + END_COL, flush=True)
+                print(m.group(1) + col + m.group(2) + END_COL, file=log_out, flush=True)
             else:
-                print(line, flush=True)
+                print(line, file=log_out, flush=True)
+
+#--------------------------------------------------------------------
+
+def text_callback(channel_index, data, _):
+    # Application channel, shown as is
+    print(data.decode(errors="replace"), end="", flush=True)
+
+#--------------------------------------------------------------------
+
+def raw_callback(channel_index, data, _):
+    sys.stdout.buffer.write(data)
+    sys.stdout.buffer.flush()
 
 #--------------------------------------------------------------------
 
@@ -54,7 +69,11 @@ def fail(mess):
 def rtt_monitor(args):
     api = LowLevel.API()
     api.open()
-    print("--- Connecting RTT...")
+    global log_out
+    if args.raw:
+        # Keep stdout for the channel data only
+        log_out = sys.stderr
+    print("--- Connecting RTT...", file=log_out)
     try:
         if args.snr:
             api.connect_to_emu_with_snr(args.snr, jlink_speed_khz=JLINK_SPEED_KHZ)
@@ -69,32 +88,46 @@ def rtt_monitor(args):
         sleep(1)
         tries += 1
         if tries > 5:
-            print("Restarting the device")
+            print("Restarting the device", file=log_out)
             api.sys_reset()
             api.go()
             tries = 0
 
-    print("- Connected. Enter command or ctrl-C to exit")
-    api.rtt_async_callback_start(COM_CHANNEL_ID, READ_SIZE, read_callback)
+    print("- Connected. Enter command or ctrl-C to exit", file=log_out)
+    api.rtt_async_callback_start(LOG_CHANNEL_ID, READ_SIZE, read_callback)
+    if args.channel != LOG_CHANNEL_ID:
+        api.rtt_async_callback_start(args.channel, READ_SIZE, raw_callback if args.raw else text_callback)
     try:
         while True:
+            if args.raw:
+                # Binary data passed on unmodified in both directions
+                data = sys.stdin.buffer.read1(READ_SIZE)
+                if not data:
+                    break
+                api.rtt_write(args.channel, data, encoding=None)
+                continue
             try:
                 cmd = input()
                 if cmd:
-                    api.rtt_write(COM_CHANNEL_ID, cmd)
+                    # Line based input is expected on other channels than the log
+                    api.rtt_write(args.channel, cmd if args.channel == LOG_CHANNEL_ID else cmd + "\n")
                 else:
                    raise EOFError
             except EOFError:
-                print(f"{RED}Use ctrl-C to exit{END_COL}")
+                print(f"{RED}Use ctrl-C to exit{END_COL}", file=log_out)
     except KeyboardInterrupt:
-        print()
+        print(file=log_out)
 
-    print("--- Disconnecting RTT...")
+    print("--- Disconnecting RTT...", file=log_out)
     api.close()
 
 if __name__ == "__main__":
     parser = ArgumentParser(description="RTT terminal")
     parser.add_argument("--snr", type=int, nargs="?", default=None, help="Optional Segger serial number")
+    parser.add_argument("--channel", type=int, default=LOG_CHANNEL_ID,
+                        help="Channel for input and application output, as set by ENRF_SERIAL=rtt")
+    parser.add_argument("--raw", action="store_true",
+                        help="Pass binary channel data via stdin and stdout, log goes to stderr")
     args = parser.parse_args()
     rtt_monitor(args)
 